@@ -1,6 +1,6 @@
 TEMPLATE = app
 TARGET =
-VERSION = 0.6.4.6
+VERSION = 0.6.4.8
 INCLUDEPATH += src src/json src/qt
 DEFINES += QT_GUI BOOST_THREAD_USE_LIB BOOST_SPIRIT_THREADSAFE USE_IPV6 __NO_SYSTEM_INCLUDES
 CONFIG += no_include_pwd
@@ -93,6 +93,20 @@ contains(USE_UPNP, -) {
 
 
 
+# use: qmake "USE_LEVELDB=1" (default) to keep the chain state in LevelDB
+#  or: qmake "USE_LEVELDB=0" to keep it in BerkeleyDB (blkindex.dat)
+isEmpty(USE_LEVELDB) {
+    !win32:USE_LEVELDB=1
+}
+contains(USE_LEVELDB, 1) {
+    message(Building with LevelDB chain state)
+    DEFINES += USE_LEVELDB
+    INCLUDEPATH += $$LEVELDB_INCLUDE_PATH
+    LIBS += $$join(LEVELDB_LIB_PATH,,-L,) -lleveldb
+    HEADERS += src/leveldb.h
+    SOURCES += src/leveldb.cpp
+}
+
 # use: qmake "USE_DBUS=1"
 contains(USE_DBUS, 1) {
     message(Building with DBUS (Freedesktop notifications) support)
@@ -148,6 +162,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/checkpoints.h \
     src/compat.h \
     src/sync.h \
+    src/checkqueue.h \
     src/util.h \
     src/uint256.h \
     src/serialize.h \
@@ -156,6 +171,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/net.h \
     src/key.h \
     src/db.h \
+    src/kvdb.h \
     src/walletdb.h \
     src/script.h \
     src/init.h \
@@ -205,6 +205,7 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
 {
     Object result;
     result.push_back(Pair("hash", block.GetHash().GetHex()));
+    result.push_back(Pair("powhash", (blockindex->hashPoW != 0 ? blockindex->hashPoW : block.GetPoWHash()).GetHex()));
     CMerkleTx txGen(block.vtx[0]);
     txGen.SetMerkleBranch(&block);
     result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
@@ -328,9 +329,7 @@ Value GetNetworkHashPS(int lookup) {
     if (lookup > pindexBest->nHeight)
         lookup = pindexBest->nHeight;
 
-    CBlockIndex* pindexPrev = pindexBest;
-    for (int i = 0; i < lookup; i++)
-        pindexPrev = pindexPrev->pprev;
+    CBlockIndex* pindexPrev = FindBlockByHeight(pindexBest->nHeight - lookup);
 
     double timeDiff = pindexBest->GetBlockTime() - pindexPrev->GetBlockTime();
     double timePerBlock = timeDiff / lookup;
@@ -416,6 +415,7 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("walletversion", pwalletMain->GetVersion()));
     obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
     obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("headers",       pindexBestHeader ? pindexBestHeader->nHeight : -1));
     obj.push_back(Pair("connections",   (int)vNodes.size()));
     obj.push_back(Pair("proxy",         (addrProxy.IsValid() ? addrProxy.ToStringIPPort() : string())));
     obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
@@ -449,11 +449,37 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
     obj.push_back(Pair("networkhashps", getnetworkhashps(params, false)));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
+    obj.push_back(Pair("pooledtxbytes", (uint64_t)mempool.nUsage));
+    obj.push_back(Pair("poolminfee",    ValueFromAmount(mempool.GetMinFee(1000))));
     obj.push_back(Pair("testnet",       fTestNet));
     return obj;
 }
 
 
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns an object containing signature cache usage and hit-rate counters.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("entries",       (uint64_t)stats.nEntries));
+    obj.push_back(Pair("bytes",         (uint64_t)stats.nBytes));
+    obj.push_back(Pair("maxbytes",      (uint64_t)stats.nMaxBytes));
+    obj.push_back(Pair("shards",        stats.nShards));
+    obj.push_back(Pair("hits",          (uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",        (uint64_t)stats.nMisses));
+    obj.push_back(Pair("evictions",     (uint64_t)stats.nEvictions));
+    uint64 nLookups = stats.nHits + stats.nMisses;
+    obj.push_back(Pair("hitrate",       nLookups ? (double)stats.nHits / nLookups : 0.0));
+    return obj;
+}
+
+
 Value getnewaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -1537,10 +1563,7 @@ Value listsinceblock(const Array& params, bool fHelp)
     {
         int target_height = pindexBest->nHeight + 1 - target_confirms;
 
-        CBlockIndex *block;
-        for (block = pindexBest;
-             block && block->nHeight > target_height;
-             block = block->pprev)  { }
+        CBlockIndex *block = FindBlockByHeight(target_height);
 
         lastblock = block ? block->GetBlockHash() : 0;
     }
@@ -1927,7 +1950,7 @@ Value getworkex(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         CTransaction coinbaseTx = pblock->vtx[0];
         std::vector<uint256> merkle = pblock->GetMerkleBranch(0);
@@ -2059,7 +2082,7 @@ Value getwork(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
@@ -2104,6 +2127,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "If [params] does not contain a \"data\" key, returns data needed to construct a block to work on:\n"
             "  \"version\" : block version\n"
             "  \"previousblockhash\" : hash of current highest block\n"
+            "  \"longpollid\" : pass back as \"longpollid\" to wait for the next block or transactions\n"
             "  \"transactions\" : contents of non-coinbase transactions that should be included in the next block\n"
             "  \"coinbaseaux\" : data that should be included in coinbase\n"
             "  \"coinbasevalue\" : maximum allowable input to coinbase transaction, including the generation award and transaction fees\n"
@@ -2142,38 +2166,42 @@ Value getblocktemplate(const Array& params, bool fHelp)
 
         static CReserveKey reservekey(pwalletMain);
 
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64 nStart;
-        static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+        // Long polling: given the longpollid of a template it already has,
+        // the miner wants an answer only once there is new work.  Let go of
+        // the locks execute() took while we wait.
+        const Value& lpval = find_value(oparam, "longpollid");
+        if (lpval.type() == str_type)
         {
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
-            nStart = GetTime();
-
-            // Create new block
-            if(pblock)
-                delete pblock;
-            pblock = CreateNewBlock(reservekey);
-            if (!pblock)
-                throw JSONRPCError(-7, "Out of memory");
+            string strLongPollId = lpval.get_str();
+            uint256 hashWatched;
+            hashWatched.SetHex(strLongPollId.substr(0, 64));
+            unsigned int nTransactionsUpdatedWatched = strLongPollId.size() > 64 ? atoi64(strLongPollId.substr(64)) : 0;
+
+            LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet);
+            LEAVE_CRITICAL_SECTION(cs_main);
+            WaitForNewWork(hashWatched, nTransactionsUpdatedWatched);
+            ENTER_CRITICAL_SECTION(cs_main);
+            ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet);
+
+            if (fShutdown)
+                throw JSONRPCError(-9, "Shutting down");
         }
+        unsigned int nTransactionsUpdatedNow = nTransactionsUpdated;
 
-        // Update nTime
-        pblock->UpdateTime(pindexPrev);
-        pblock->nNonce = 0;
+        // The shared template is kept current for us, so this is cheap
+        vector<int64> vTxFees, vTxSigOps;
+        auto_ptr<CBlock> pblock(CreateNewBlock(reservekey, &vTxFees, &vTxSigOps));
+        if (!pblock.get())
+            throw JSONRPCError(-7, "Out of memory");
+        CBlockIndex* pindexPrev = mapBlockIndex[pblock->hashPrevBlock];
 
         Array transactions;
         map<uint256, int64_t> setTxIndex;
-        int i = 0;
-        CTxDB txdb("r");
-        BOOST_FOREACH (CTransaction& tx, pblock->vtx)
+        for (unsigned int i = 0; i < pblock->vtx.size(); i++)
         {
+            CTransaction& tx = pblock->vtx[i];
             uint256 txHash = tx.GetHash();
-            setTxIndex[txHash] = i++;
+            setTxIndex[txHash] = i;
 
             if (tx.IsCoinBase())
                 continue;
@@ -2185,26 +2213,20 @@ Value getblocktemplate(const Array& params, bool fHelp)
             entry.push_back(Pair("data", HexStr(ssTx.begin(), ssTx.end())));
 
             entry.push_back(Pair("hash", txHash.GetHex()));
+            entry.push_back(Pair("fee", (int64_t)vTxFees[i]));
 
-            MapPrevTx mapInputs;
-            map<uint256, CTxIndex> mapUnused;
-            bool fInvalid = false;
-            if (tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+            set<int64_t> setDeps;
+            BOOST_FOREACH (const CTxIn& txin, tx.vin)
             {
-                entry.push_back(Pair("fee", (int64_t)(tx.GetValueIn(mapInputs) - tx.GetValueOut())));
-
-                Array deps;
-                BOOST_FOREACH (MapPrevTx::value_type& inp, mapInputs)
-                {
-                    if (setTxIndex.count(inp.first))
-                        deps.push_back(setTxIndex[inp.first]);
-                }
-                entry.push_back(Pair("depends", deps));
-
-                int64_t nSigOps = tx.GetLegacySigOpCount();
-                nSigOps += tx.GetP2SHSigOpCount(mapInputs);
-                entry.push_back(Pair("sigops", nSigOps));
+                if (setTxIndex.count(txin.prevout.hash))
+                    setDeps.insert(setTxIndex[txin.prevout.hash]);
             }
+            Array deps;
+            BOOST_FOREACH (int64_t nDep, setDeps)
+                deps.push_back(nDep);
+            entry.push_back(Pair("depends", deps));
+
+            entry.push_back(Pair("sigops", (int64_t)vTxSigOps[i]));
 
             transactions.push_back(entry);
         }
@@ -2212,7 +2234,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         Object aux;
         aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         static Array aMutable;
         if (aMutable.empty())
@@ -2225,6 +2247,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
         Object result;
         result.push_back(Pair("version", pblock->nVersion));
         result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
+        result.push_back(Pair("longpollid", pblock->hashPrevBlock.GetHex() + i64tostr(nTransactionsUpdatedNow)));
         result.push_back(Pair("transactions", transactions));
         result.push_back(Pair("coinbaseaux", aux));
         result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
@@ -2284,10 +2307,7 @@ Value getblockhash(const Array& params, bool fHelp)
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -2370,6 +2390,7 @@ static const CRPCCommand vRPCCommands[] =
     { "gethashespersec",        &gethashespersec,        true },
     { "getinfo",                &getinfo,                true },
     { "getmininginfo",          &getmininginfo,          true },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true },
     { "getnewaddress",          &getnewaddress,          true },
     { "getaccountaddress",      &getaccountaddress,      true },
     { "setaccount",             &setaccount,             true },
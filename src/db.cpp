@@ -9,6 +9,10 @@
 #include "db.h"
 #include "util.h"
 #include "main.h"
+#include "checkqueue.h"
+#ifdef USE_LEVELDB
+#include "leveldb.h"
+#endif
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -81,7 +85,13 @@ bool CDBEnv::Open(boost::filesystem::path pathEnv_)
     if (GetBoolArg("-privdb", true))
         nEnvFlags |= DB_PRIVATE;
 
-    int nDbCache = GetArg("-dbcache", 25);
+#ifdef USE_LEVELDB
+    // Only the wallet lives here; the chain state has its own cache
+    int nDbCache = 4;
+#else
+    // -dbcache is shared with the coin cache, which gets the rest
+    int nDbCache = std::max(1, (int)GetArg("-dbcache", 100) / 4);
+#endif
     dbenv.set_lg_dir(pathLogDir.string().c_str());
     dbenv.set_cachesize(nDbCache / 1024, (nDbCache % 1024)*1048576, 1);
     dbenv.set_lg_bsize(1048576);
@@ -366,10 +376,325 @@ void CDBEnv::Flush(bool fShutdown)
 
 
 
+//
+// CBerkeleyKeyValueDB
+//
+
+class CBerkeleyCursor : public CKeyValueCursor
+{
+private:
+    Dbc* pcursor;
+    bool fValid;
+    bool fOk;
+    std::string strKey;
+    std::string strValue;
+
+    void ReadAt(unsigned int fFlags)
+    {
+        Dbt datKey;
+        if (fFlags == DB_SET_RANGE)
+        {
+            datKey.set_data((void*)strKey.data());
+            datKey.set_size(strKey.size());
+        }
+        Dbt datValue;
+        datKey.set_flags(DB_DBT_MALLOC);
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pcursor ? pcursor->get(&datKey, &datValue, fFlags) : EINVAL;
+        if (ret != 0)
+        {
+            fValid = false;
+            fOk = (ret == DB_NOTFOUND);
+            return;
+        }
+        fValid = fOk = (datKey.get_data() != NULL && datValue.get_data() != NULL);
+        if (fValid)
+        {
+            strKey.assign((const char*)datKey.get_data(), datKey.get_size());
+            strValue.assign((const char*)datValue.get_data(), datValue.get_size());
+        }
+        free(datKey.get_data());
+        free(datValue.get_data());
+    }
+
+public:
+    CBerkeleyCursor(Dbc* pcursorIn) : pcursor(pcursorIn), fValid(false), fOk(pcursorIn != NULL) { }
+    ~CBerkeleyCursor()
+    {
+        if (pcursor)
+            pcursor->close();
+    }
+
+    void Seek(const std::string& key)
+    {
+        strKey = key;
+        ReadAt(key.empty() ? DB_FIRST : DB_SET_RANGE);
+    }
+    void Next() { ReadAt(DB_NEXT); }
+    bool Valid() const { return fValid; }
+    bool Ok() const { return fOk; }
+    std::string GetKey() const { return strKey; }
+    std::string GetValue() const { return strValue; }
+};
+
+bool CBerkeleyKeyValueDB::Read(const std::string& key, std::string& value)
+{
+    if (!pdb)
+        return false;
+    Dbt datKey((void*)key.data(), key.size());
+    Dbt datValue;
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = pdb->get(NULL, &datKey, &datValue, 0);
+    if (datValue.get_data() == NULL)
+        return false;
+    value.assign((const char*)datValue.get_data(), datValue.get_size());
+    free(datValue.get_data());
+    return (ret == 0);
+}
+
+bool CBerkeleyKeyValueDB::Exists(const std::string& key)
+{
+    if (!pdb)
+        return false;
+    Dbt datKey((void*)key.data(), key.size());
+    return (pdb->exists(NULL, &datKey, 0) == 0);
+}
+
+bool CBerkeleyKeyValueDB::WriteBatch(const CKeyValueBatch& batch)
+{
+    if (!pdb)
+        return false;
+    if (fReadOnly)
+        assert(!"WriteBatch called on database in read-only mode");
+
+    DbTxn* ptxn = bitdb.TxnBegin();
+    if (!ptxn)
+        return false;
+    for (CKeyValueBatch::writemap_type::const_iterator mi = batch.mapWrites.begin(); mi != batch.mapWrites.end(); ++mi)
+    {
+        Dbt datKey((void*)(*mi).first.data(), (*mi).first.size());
+        int ret;
+        if ((*mi).second.first)
+        {
+            ret = pdb->del(ptxn, &datKey, 0);
+            if (ret == DB_NOTFOUND)
+                ret = 0;
+        }
+        else
+        {
+            Dbt datValue((void*)(*mi).second.second.data(), (*mi).second.second.size());
+            ret = pdb->put(ptxn, &datKey, &datValue, 0);
+        }
+        if (ret != 0)
+        {
+            ptxn->abort();
+            return false;
+        }
+    }
+    if (ptxn->commit(0) != 0)
+        return false;
+
+    // Move log data into the file now and then, as closing a CDB used to
+    unsigned int nMinutes = IsInitialBlockDownload() ? 5 : 2;
+    bitdb.dbenv.txn_checkpoint(GetArg("-dblogsize", 100)*1024, nMinutes, 0);
+    return true;
+}
+
+CKeyValueCursor* CBerkeleyKeyValueDB::NewCursor()
+{
+    Dbc* pcursor = NULL;
+    if (pdb && pdb->cursor(NULL, &pcursor, 0) != 0)
+        pcursor = NULL;
+    return new CBerkeleyCursor(pcursor);
+}
+
+
+
+//
+// Chain state database
+//
+
+static CCriticalSection cs_chaindb;
+static CKeyValueDB* pchaindb = NULL;
+
+#ifdef USE_LEVELDB
+// One-time upgrade: copy every record of blkindex.dat into LevelDB, then move
+// blkindex.dat aside.  Until that rename the import starts over on each run.
+static bool ImportBlkIndex(CKeyValueDB* pdbTo)
+{
+    printf("Importing blkindex.dat into txleveldb...\n");
+    int64 nStart = GetTimeMillis();
+    unsigned int nRecords = 0;
+    {
+        CBerkeleyKeyValueDB dbFrom("blkindex.dat", "r");
+        CKeyValueCursor* pcursor = dbFrom.NewCursor();
+        CKeyValueBatch batch;
+        for (pcursor->Seek(""); pcursor->Valid() && !fRequestShutdown; pcursor->Next())
+        {
+            batch.Write(pcursor->GetKey(), pcursor->GetValue());
+            nRecords++;
+            if (batch.size() >= 10000)
+            {
+                if (!pdbTo->WriteBatch(batch))
+                    break;
+                batch.clear();
+            }
+        }
+        bool fOk = pcursor->Ok() && !fRequestShutdown && pdbTo->WriteBatch(batch);
+        delete pcursor;
+        if (!fOk)
+            return error("ImportBlkIndex() : copying records failed");
+    }
+
+    {
+        LOCK(bitdb.cs_db);
+        bitdb.CloseDb("blkindex.dat");
+        bitdb.CheckpointLSN("blkindex.dat");
+        bitdb.mapFileUseCount.erase("blkindex.dat");
+        Db db(&bitdb.dbenv, 0);
+        if (db.rename("blkindex.dat", NULL, "blkindex.dat.old", 0))
+            return error("ImportBlkIndex() : renaming blkindex.dat failed");
+    }
+
+    printf("Imported %u records in %"PRI64d"ms; blkindex.dat.old can be deleted\n", nRecords, GetTimeMillis() - nStart);
+    return true;
+}
+#endif
+
+static CKeyValueDB* OpenChainDB()
+{
+    LOCK(cs_chaindb);
+    if (pchaindb)
+        return pchaindb;
+
+#ifdef USE_LEVELDB
+    filesystem::path pathLevelDB = GetDataDir() / "txleveldb";
+    bool fImport = filesystem::exists(GetDataDir() / "blkindex.dat");
+    if (fImport)
+        filesystem::remove_all(pathLevelDB);
+
+    // Same share of -dbcache as the BerkeleyDB environment had
+    size_t nCacheSize = (size_t)std::max(1, (int)GetArg("-dbcache", 100) / 4) << 20;
+    CKeyValueDB* pdbNew = new CLevelDB(pathLevelDB, nCacheSize);
+    if (fImport && !ImportBlkIndex(pdbNew))
+    {
+        delete pdbNew;
+        throw runtime_error("OpenChainDB() : importing blkindex.dat failed");
+    }
+#else
+    CKeyValueDB* pdbNew = new CBerkeleyKeyValueDB("blkindex.dat");
+#endif
+
+    // Stamp a new database with the version that created it
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string("version");
+    if (!pdbNew->Exists(ssKey.str()))
+    {
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue << CLIENT_VERSION;
+        CKeyValueBatch batch;
+        batch.Write(ssKey.str(), ssValue.str());
+        pdbNew->WriteBatch(batch);
+    }
+
+    pchaindb = pdbNew;
+    return pchaindb;
+}
+
+void CloseChainDB()
+{
+    LOCK(cs_chaindb);
+    delete pchaindb;
+    pchaindb = NULL;
+}
+
+
+
 //
 // CTxDB
 //
 
+CTxDB::CTxDB(const char* pszMode) : pdb(NULL), fTxn(false)
+{
+    fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
+    pdb = OpenChainDB();
+}
+
+void CTxDB::Close()
+{
+    // Pending writes are dropped, like an open BerkeleyDB transaction
+    fTxn = false;
+    batch.clear();
+}
+
+bool CTxDB::ReadRaw(const std::string& key, std::string& value)
+{
+    if (fTxn)
+    {
+        CKeyValueBatch::writemap_type::const_iterator mi = batch.mapWrites.find(key);
+        if (mi != batch.mapWrites.end())
+        {
+            if ((*mi).second.first)
+                return false;
+            value = (*mi).second.second;
+            return true;
+        }
+    }
+    return pdb->Read(key, value);
+}
+
+bool CTxDB::WriteRaw(const std::string& key, const std::string& value)
+{
+    if (fTxn)
+    {
+        batch.Write(key, value);
+        return true;
+    }
+    CKeyValueBatch batchOne;
+    batchOne.Write(key, value);
+    return pdb->WriteBatch(batchOne);
+}
+
+bool CTxDB::EraseRaw(const std::string& key)
+{
+    if (fTxn)
+    {
+        batch.Erase(key);
+        return true;
+    }
+    CKeyValueBatch batchOne;
+    batchOne.Erase(key);
+    return pdb->WriteBatch(batchOne);
+}
+
+bool CTxDB::TxnBegin()
+{
+    if (fTxn)
+        return false;
+    fTxn = true;
+    batch.clear();
+    return true;
+}
+
+bool CTxDB::TxnCommit()
+{
+    if (!fTxn)
+        return false;
+    fTxn = false;
+    bool fOk = pdb->WriteBatch(batch);
+    batch.clear();
+    return fOk;
+}
+
+bool CTxDB::TxnAbort()
+{
+    if (!fTxn)
+        return false;
+    fTxn = false;
+    batch.clear();
+    return true;
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
@@ -389,7 +714,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
 
     // Add to tx index
     uint256 hash = tx.GetHash();
-    CTxIndex txindex(pos, tx.vout.size());
+    CTxIndex txindex(pos);
     return Write(make_pair(string("tx"), hash), txindex);
 }
 
@@ -433,6 +758,53 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+bool CTxDB::ReadCoins(uint256 hash, CCoins& coins)
+{
+    assert(!fClient);
+    coins.SetNull();
+    return Read(make_pair(string("coins"), hash), coins);
+}
+
+bool CTxDB::WriteCoins(uint256 hash, const CCoins& coins)
+{
+    assert(!fClient);
+    return Write(make_pair(string("coins"), hash), coins);
+}
+
+bool CTxDB::EraseCoins(uint256 hash)
+{
+    assert(!fClient);
+    return Erase(make_pair(string("coins"), hash));
+}
+
+bool CTxDB::HaveCoins(uint256 hash)
+{
+    assert(!fClient);
+    return Exists(make_pair(string("coins"), hash));
+}
+
+bool CTxDB::ReadBestCoins(uint256& hashBestCoins)
+{
+    return Read(string("hashBestCoins"), hashBestCoins);
+}
+
+bool CTxDB::WriteBestCoins(uint256 hashBestCoins)
+{
+    return Write(string("hashBestCoins"), hashBestCoins);
+}
+
+bool CTxDB::ReadBlockUndo(uint256 hashBlock, CBlockUndo& blockundo)
+{
+    assert(!fClient);
+    return Read(make_pair(string("blockundo"), hashBlock), blockundo);
+}
+
+bool CTxDB::WriteBlockUndo(uint256 hashBlock, const CBlockUndo& blockundo)
+{
+    assert(!fClient);
+    return Write(make_pair(string("blockundo"), hashBlock), blockundo);
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
@@ -448,14 +820,30 @@ bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
     return Write(string("hashBestChain"), hashBestChain);
 }
 
-bool CTxDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
+// Stored as a CBigNum, as older clients wrote it
+bool CTxDB::ReadBestInvalidWork(uint256& nBestInvalidWork)
+{
+    CBigNum bnBestInvalidWork;
+    if (!Read(string("bnBestInvalidWork"), bnBestInvalidWork))
+        return false;
+    nBestInvalidWork = bnBestInvalidWork.getuint256();
+    return true;
+}
+
+bool CTxDB::WriteBestInvalidWork(const uint256& nBestInvalidWork)
 {
-    return Read(string("bnBestInvalidWork"), bnBestInvalidWork);
+    return Write(string("bnBestInvalidWork"), CBigNum(nBestInvalidWork));
 }
 
-bool CTxDB::WriteBestInvalidWork(CBigNum bnBestInvalidWork)
+// Entries in the block index, so a snapshot can tell it hasn't missed any
+bool CTxDB::ReadBlockIndexCount(unsigned int& nCount)
 {
-    return Write(string("bnBestInvalidWork"), bnBestInvalidWork);
+    return Read(string("nBlockIndexCount"), nCount);
+}
+
+bool CTxDB::WriteBlockIndexCount(unsigned int nCount)
+{
+    return Write(string("nBlockIndexCount"), nCount);
 }
 
 CBlockIndex static * InsertBlockIndex(uint256 hash)
@@ -464,42 +852,83 @@ CBlockIndex static * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = NewBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+// Fill in the entry for hashBlock from a copy read back from disk
+CBlockIndex static * LoadBlockIndexEntry(const uint256& hashBlock, const uint256& hashPrev, const CBlockIndex& index)
+{
+    CBlockIndex* pindexNew = InsertBlockIndex(hashBlock);
+    pindexNew->pprev          = InsertBlockIndex(hashPrev);
+    pindexNew->nFile          = index.nFile;
+    pindexNew->nBlockPos      = index.nBlockPos;
+    pindexNew->nHeight        = index.nHeight;
+    pindexNew->nVersion       = index.nVersion;
+    pindexNew->hashMerkleRoot = index.hashMerkleRoot;
+    pindexNew->nTime          = index.nTime;
+    pindexNew->nBits          = index.nBits;
+    pindexNew->nNonce         = index.nNonce;
+    pindexNew->hashPoW        = index.hashPoW;
+
+    // Watch for genesis block
+    if (pindexGenesisBlock == NULL && hashBlock == hashGenesisBlock)
+        pindexGenesisBlock = pindexNew;
+
+    return pindexNew;
+}
+
 bool CTxDB::LoadBlockIndex()
 {
-    if (!LoadBlockIndexGuts())
-        return false;
+    // Take the entries from the snapshot a clean shutdown leaves if it is
+    // current, else walk the database; the snapshot is already in height order
+    int64 nStart = GetTimeMillis();
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    bool fSnapshot = LoadBlockIndexSnapshot(vSortedByHeight);
+    if (!fSnapshot)
+    {
+        vSortedByHeight.clear();
+        if (!LoadBlockIndexGuts())
+            return false;
+
+        // Start counting entries for the next snapshot
+        unsigned int nCount = 0;
+        if (!fRequestShutdown && (!ReadBlockIndexCount(nCount) || nCount != mapBlockIndex.size()))
+            WriteBlockIndexCount(mapBlockIndex.size());
+    }
 
     if (fRequestShutdown)
         return true;
+    printf("LoadBlockIndex(): read %u entries from the %s in %"PRI64d"ms\n", (unsigned int)mapBlockIndex.size(),
+      fSnapshot ? "snapshot" : "database", GetTimeMillis() - nStart);
 
-    // Calculate bnChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    // Calculate nChainWork and skip pointers
+    nStart = GetTimeMillis();
+    if (!fSnapshot)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + pindex->GetBlockWork();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork();
+        pindex->BuildSkip();
     }
+    printf("LoadBlockIndex(): chain work computed in %"PRI64d"ms\n", GetTimeMillis() - nStart);
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -511,167 +940,486 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    SetMainChainIndex(pindexBest);
     nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexBest->bnChainWork;
+    nBestChainWork = pindexBest->nChainWork;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  date=%s\n",
       hashBestChain.ToString().substr(0,20).c_str(), nBestHeight,
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
-    // Load bnBestInvalidWork, OK if it doesn't exist
-    ReadBestInvalidWork(bnBestInvalidWork);
+    // Load nBestInvalidWork, OK if it doesn't exist
+    ReadBestInvalidWork(nBestInvalidWork);
+
+    // Upgrade: databases from before the coin records keep spent flags in
+    // the transaction index; build the unspent output set from those
+    int nCoinsVersion = 0;
+    ReadVersion(nCoinsVersion);
+    if (nCoinsVersion < COINS_INDEX_VERSION && !BuildCoinsFromTxIndex())
+        return error("LoadBlockIndex() : building unspent output database failed");
+
+    nStart = GetTimeMillis();
+
+    // Coin changes are written out lazily; if the last run did not get to
+    // write them all, replay the blocks since the coin database's best block.
+    // The marker is written with the genesis block, so a missing marker
+    // past genesis means the first flush never happened: replay everything.
+    uint256 hashBestCoins;
+    if (!ReadBestCoins(hashBestCoins))
+        hashBestCoins = hashGenesisBlock;
+    if (hashBestCoins != hashBestChain)
+    {
+        if (!mapBlockIndex.count(hashBestCoins))
+            return error("LoadBlockIndex() : coin database best block not found in the block index");
+        if (!ReplayCoins(mapBlockIndex[hashBestCoins]))
+            return error("LoadBlockIndex() : replaying unspent outputs failed");
+    }
+    else
+        coinsTip.SetBestBlock(hashBestChain);
+    printf("LoadBlockIndex(): unspent outputs ready in %"PRI64d"ms\n", GetTimeMillis() - nStart);
+
+    // Upgrade: stamp the database version once.  Older entries get their
+    // scrypt hash recorded as the background verification re-checks them.
+    int nDbVersion = 0;
+    ReadVersion(nDbVersion);
+    if (nDbVersion < POWHASH_INDEX_VERSION)
+    {
+        printf("LoadBlockIndex() : upgrading blkindex.dat from version %d to %d\n", nDbVersion, CLIENT_VERSION);
+        CTxDB txdb;
+        if (!txdb.WriteVersion(CLIENT_VERSION))
+            return error("LoadBlockIndex() : writing version failed");
+    }
 
-    // Verify blocks in the best chain
-    int nCheckLevel = GetArg("-checklevel", 1);
-    int nCheckDepth = GetArg( "-checkblocks", 2500);
-    if (nCheckDepth == 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    return true;
+}
+
+
+
+//
+// Verification of the last -checkblocks blocks
+//
+// Done once the node is up and serving rather than holding up startup, a
+// batch of blocks at a time, best first, spread over the -par threads.  If a
+// block turns out bad while it is still in the best chain, the best chain is
+// moved back to below it.
+//
+
+// What checking one block found
+struct CBlockVerifyResult
+{
+    bool fBad;
+    uint256 hashPoW; // scrypt hash computed for an entry that had none
+
+    CBlockVerifyResult() : fBad(false), hashPoW(0) { }
+};
+
+class CBlockVerifyCheck
+{
+public:
+    CBlockIndex* pindex;
+    int nCheckLevel;
+    CBlockVerifyResult* presult;
+
+    CBlockVerifyCheck() : pindex(NULL), nCheckLevel(0), presult(NULL) { }
+    CBlockVerifyCheck(CBlockIndex* pindexIn, int nCheckLevelIn, CBlockVerifyResult* presultIn) :
+        pindex(pindexIn), nCheckLevel(nCheckLevelIn), presult(presultIn) { }
+
+    // Always true, so that one bad block doesn't stop the rest of the batch
+    bool operator()();
+
+    void swap(CBlockVerifyCheck& check)
     {
-        if (fRequestShutdown || pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        if (nCheckLevel>0 && !block.CheckBlock())
-        {
-            printf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
+        std::swap(pindex, check.pindex);
+        std::swap(nCheckLevel, check.nCheckLevel);
+        std::swap(presult, check.presult);
+    }
+};
+
+// Set by StopVerifyBlocks(); checks still queued then finish without running
+static bool fVerifyQuit = false;
+
+bool CBlockVerifyCheck::operator()()
+{
+    if (fVerifyQuit || fShutdown)
+        return true;
+    CTxDB txdb("r");
+    bool& fBad = presult->fBad;
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+    {
+        printf("VerifyBlocks() : *** cannot read block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        fBad = true;
+        return true;
+    }
+    // check level 1: verify block validity
+    if (nCheckLevel>0 && !block.CheckBlock(pindex))
+    {
+        printf("VerifyBlocks() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        fBad = true;
+    }
+    else if (nCheckLevel>0 && pindex->hashPoW == 0)
+    {
+        // Entry predates the recorded scrypt hash; keep the one just computed
+        presult->hashPoW = block.hashPoWChecked;
+    }
+    // check level 2: verify transaction index validity
+    if (nCheckLevel>1)
+    {
+        BOOST_FOREACH(const CTransaction &tx, block.vtx)
         {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
+            uint256 hashTx = tx.GetHash();
+            CTxIndex txindex;
+            if (txdb.ReadTxIndex(hashTx, txindex))
             {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
+                // check level 3: checker transaction hashes
+                if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
                 {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+                    // either an error or a duplicate transaction
+                    CTransaction txFound;
+                    if (!txFound.ReadFromDisk(txindex.pos))
                     {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
+                        printf("VerifyBlocks() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
+                        fBad = true;
+                    }
+                    else
+                        if (txFound.GetHash() != hashTx) // not a duplicate tx
                         {
-                            printf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
-                            pindexFork = pindex->pprev;
+                            printf("VerifyBlocks() : *** invalid tx position for %s\n", hashTx.ToString().c_str());
+                            fBad = true;
                         }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                printf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
+                }
+            }
+        }
+    }
+    // check level 4: check whether the unspent outputs recorded for each transaction are its own
+    if (nCheckLevel>3)
+    {
+        // Coins of recent blocks may still be only in coinsTip, so read
+        // through it, and only while the block is still in the best chain
+        LOCK(cs_main);
+        if (!pindex->IsInMainChain())
+            return true;
+        CCoinsCache view(txdb);
+        BOOST_FOREACH(const CTransaction &tx, block.vtx)
+        {
+            uint256 hashTx = tx.GetHash();
+            CCoins coins;
+            if (view.GetCoins(hashTx, coins))
+            {
+                if (coins.fCoinBase != tx.IsCoinBase() || coins.vout.size() != tx.vout.size())
+                {
+                    printf("VerifyBlocks() : *** unspent outputs of %s do not match the transaction\n", hashTx.ToString().c_str());
+                    fBad = true;
+                }
+                // check level 6: check the heights and values of the unspent outputs too
+                else if (nCheckLevel>5)
+                {
+                    if (coins.nHeight != pindex->nHeight)
                     {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                        printf("VerifyBlocks() : *** unspent outputs of %s recorded at height %d instead of %d\n", hashTx.ToString().c_str(), coins.nHeight, pindex->nHeight);
+                        fBad = true;
+                    }
+                    for (unsigned int nOutput = 0; nOutput < coins.vout.size(); nOutput++)
+                        if (coins.IsAvailable(nOutput) && coins.vout[nOutput] != tx.vout[nOutput])
                         {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    printf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        printf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        printf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            printf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
-                            }
-                            nOutput++;
+                            printf("VerifyBlocks() : *** unspent output %s:%i differs from the transaction\n", hashTx.ToString().c_str(), nOutput);
+                            fBad = true;
                         }
-                    }
                 }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
+            }
+            // check level 5: check whether all prevouts are marked spent
+            if (nCheckLevel>4)
+            {
+                 BOOST_FOREACH(const CTxIn &txin, tx.vin)
+                 {
+                      if (view.GetCoins(txin.prevout.hash, coins) && coins.IsAvailable(txin.prevout.n))
+                      {
+                          printf("VerifyBlocks() : *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
+                          fBad = true;
+                      }
+                 }
+            }
+        }
+    }
+    return true;
+}
+
+static CCheckQueue<CBlockVerifyCheck> verifycheckqueue(4);
+
+void static ThreadVerifyCheck(void* parg)
+{
+    // Make this thread recognisable as a verification thread
+    RenameThread("bitcoin-verifych");
+
+    try
+    {
+        vnThreadsRunning[THREAD_VERIFY]++;
+        verifycheckqueue.Thread();
+        vnThreadsRunning[THREAD_VERIFY]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_VERIFY]--;
+        PrintException(&e, "ThreadVerifyCheck()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_VERIFY]--;
+        PrintException(NULL, "ThreadVerifyCheck()");
+    }
+}
+
+static void VerifyBlocks()
+{
+    int nCheckLevel = GetArg("-checklevel", 1);
+    int nCheckDepth = GetArg("-checkblocks", 2500);
+    if (nCheckDepth == 0)
+        nCheckDepth = 1000000000; // suffices until the year 19000
+
+    // Entries are never freed, so these stay good while the chain moves on
+    vector<CBlockIndex*> vToCheck;
+    CBlockIndex* pindexBestChecked;
+    {
+        LOCK(cs_main);
+        if (fShutdown || fVerifyQuit)
+            return;
+        pindexBestChecked = pindexBest;
+        for (int nHeight = nBestHeight; nHeight > 0 && nHeight >= nBestHeight - nCheckDepth; nHeight--)
+            vToCheck.push_back(FindBlockByHeight(nHeight));
+    }
+    if (vToCheck.empty())
+        return;
+    printf("Verifying last %u blocks at level %i\n", (unsigned int)vToCheck.size(), nCheckLevel);
+    int64 nStart = GetTimeMillis();
+
+    // The thread submitting the checks does its share, so start one fewer
+    for (int i = 0; i < nVerifyThreads - 1; i++)
+        if (!CreateThread(ThreadVerifyCheck, NULL))
+            printf("Error: CreateThread(ThreadVerifyCheck) failed\n");
+
+    CBlockIndex* pindexFork = NULL;
+    vector<CBlockIndex*> vPoWHashUpdated;
+    unsigned int nBatch = 16 * max(nVerifyThreads, 1);
+    unsigned int nDone = 0;
+    while (nDone < vToCheck.size() && !fShutdown && !fVerifyQuit)
+    {
+        unsigned int nEnd = min(nDone + nBatch, (unsigned int)vToCheck.size());
+        vector<CBlockVerifyResult> vResults(nEnd - nDone);
+        vector<CBlockVerifyCheck> vChecks;
+        for (unsigned int i = nDone; i < nEnd; i++)
+            vChecks.push_back(CBlockVerifyCheck(vToCheck[i], nCheckLevel, &vResults[i - nDone]));
+        CCheckQueueControl<CBlockVerifyCheck> control(&verifycheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+
+        {
+            LOCK(cs_main);
+            for (unsigned int i = nDone; i < nEnd; i++)
+            {
+                CBlockIndex* pindex = vToCheck[i];
+                const CBlockVerifyResult& result = vResults[i - nDone];
+                // A block a reorganization has since taken out doesn't matter
+                if (result.fBad && pindex->IsInMainChain())
+                    pindexFork = pindex->pprev;
+                else if (result.hashPoW != 0 && pindex->hashPoW == 0)
                 {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
+                    pindex->hashPoW = result.hashPoW;
+                    vPoWHashUpdated.push_back(pindex);
                 }
             }
         }
+
+        // Report every tenth of the way
+        unsigned int nTenths = nEnd * 10 / vToCheck.size();
+        if (nTenths != nDone * 10 / vToCheck.size())
+            printf("Verifying blocks: %u%% done, down to height %d\n", nTenths * 10, vToCheck[nEnd - 1]->nHeight);
+        nDone = nEnd;
     }
-    if (pindexFork && !fRequestShutdown)
+    verifycheckqueue.Quit();
+    printf("VerifyBlocks(): %s %u blocks in %"PRI64d"ms\n", nDone < vToCheck.size() ? "interrupted after" : "verified",
+      nDone, GetTimeMillis() - nStart);
+
+    LOCK(cs_main);
+
+    // Shutdown flushes and closes the chain database once this thread is gone
+    if (fShutdown || fVerifyQuit)
+        return;
+
+    // Persist the scrypt hashes that had to be computed
+    if (!vPoWHashUpdated.empty())
+    {
+        CTxDB txdb;
+        if (!txdb.TxnBegin())
+        {
+            printf("VerifyBlocks() : TxnBegin failed\n");
+            return;
+        }
+        BOOST_FOREACH(CBlockIndex* pindex, vPoWHashUpdated)
+            txdb.WriteBlockIndex(CDiskBlockIndex(pindex));
+        if (!txdb.TxnCommit())
+        {
+            printf("VerifyBlocks() : TxnCommit failed\n");
+            return;
+        }
+        printf("VerifyBlocks() : recorded proof-of-work hash for %u blocks\n", (unsigned int)vPoWHashUpdated.size());
+    }
+
+    // Leave a chain that has moved on since to the usual block checks
+    if (pindexFork && pindexFork->IsInMainChain() && pindexBest == pindexBestChecked)
     {
         // Reorg back to the fork
-        printf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
+        printf("VerifyBlocks() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
         CBlock block;
         if (!block.ReadFromDisk(pindexFork))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
+        {
+            printf("VerifyBlocks() : block.ReadFromDisk failed\n");
+            return;
+        }
         CTxDB txdb;
         block.SetBestChain(txdb, pindexFork);
     }
+}
 
-    return true;
+void ThreadVerifyBlocks(void* parg)
+{
+    // Make this thread recognisable as the verification thread
+    RenameThread("bitcoin-verify");
+
+    try
+    {
+        vnThreadsRunning[THREAD_VERIFY]++;
+        VerifyBlocks();
+        vnThreadsRunning[THREAD_VERIFY]--;
+    }
+    catch (std::exception& e) {
+        // Let the check threads exit too
+        verifycheckqueue.Quit();
+        vnThreadsRunning[THREAD_VERIFY]--;
+        PrintException(&e, "ThreadVerifyBlocks()");
+    } catch (...) {
+        verifycheckqueue.Quit();
+        vnThreadsRunning[THREAD_VERIFY]--;
+        PrintException(NULL, "ThreadVerifyBlocks()");
+    }
 }
 
+void StopVerifyBlocks()
+{
+    fVerifyQuit = true;
+    verifycheckqueue.Quit();
+}
+
+
+
+bool CTxDB::BuildCoinsFromTxIndex()
+{
+    printf("Building unspent output database from the transaction index...\n");
+    int64 nStart = GetTimeMillis();
+
+    // Collect transactions with outputs still unspent.  Entries whose spent
+    // vector does not cover every output were written after the coin records
+    // existed, and their coins are already there.
+    vector<pair<uint256, CTxIndex> > vUnspent;
+    vector<vector<CDiskTxPos> > vUnspentSpent;
+    CKeyValueCursor* pcursor = GetCursor(make_pair(string("tx"), uint256(0)));
+    for (; pcursor->Valid(); pcursor->Next())
+    {
+        string strKey = pcursor->GetKey();
+        string strValue = pcursor->GetValue();
+        CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+
+        string strType;
+        ssKey >> strType;
+        if (strType != "tx" || fRequestShutdown)
+            break;
+        uint256 hashTx;
+        ssKey >> hashTx;
+
+        // Old layout of a CTxIndex record
+        int nVersion;
+        CTxIndex txindex;
+        vector<CDiskTxPos> vSpent;
+        ssValue >> nVersion >> txindex.pos >> vSpent;
+
+        BOOST_FOREACH(const CDiskTxPos& pos, vSpent)
+        {
+            if (pos.IsNull())
+            {
+                vUnspent.push_back(make_pair(hashTx, txindex));
+                vUnspentSpent.push_back(vSpent);
+                break;
+            }
+        }
+    }
+    bool fCursorOk = pcursor->Ok();
+    delete pcursor;
+    if (!fCursorOk || fRequestShutdown)
+        return false;
+
+    // Write coin records in batches, the last one together with the version
+    // that marks the upgrade as done
+    CTxDB txdb;
+    const unsigned int nBatch = 1000;
+    unsigned int nWritten = 0;
+    for (unsigned int i = 0; i <= vUnspent.size(); i += nBatch)
+    {
+        if (!txdb.TxnBegin())
+            return error("BuildCoinsFromTxIndex() : TxnBegin failed");
+        for (unsigned int j = i; j < vUnspent.size() && j < i + nBatch; j++)
+        {
+            const uint256& hashTx = vUnspent[j].first;
+            const CTxIndex& txindex = vUnspent[j].second;
+            const vector<CDiskTxPos>& vSpent = vUnspentSpent[j];
+
+            CTransaction tx;
+            if (!tx.ReadFromDisk(txindex.pos))
+            {
+                txdb.TxnAbort();
+                return error("BuildCoinsFromTxIndex() : ReadFromDisk tx %s failed", hashTx.ToString().substr(0,10).c_str());
+            }
+            if (vSpent.size() != tx.vout.size())
+                continue;
+            int nHeight = txindex.GetHeightInMainChain();
+            if (nHeight < 0)
+            {
+                printf("BuildCoinsFromTxIndex() : tx %s not in main chain, skipped\n", hashTx.ToString().substr(0,10).c_str());
+                continue;
+            }
+
+            CCoins coins(tx, nHeight);
+            for (unsigned int n = 0; n < vSpent.size(); n++)
+                if (!vSpent[n].IsNull())
+                    coins.vout[n].SetNull();
+            if (!txdb.WriteCoins(hashTx, coins))
+            {
+                txdb.TxnAbort();
+                return error("BuildCoinsFromTxIndex() : WriteCoins failed");
+            }
+            nWritten++;
+        }
+        if (i + nBatch > vUnspent.size())
+        {
+            txdb.WriteBestCoins(hashBestChain);
+            txdb.WriteVersion(CLIENT_VERSION);
+        }
+        if (!txdb.TxnCommit())
+            return error("BuildCoinsFromTxIndex() : TxnCommit failed");
+    }
 
+    printf("Built unspent outputs of %u transactions in %"PRI64d"ms\n", nWritten, GetTimeMillis() - nStart);
+    return true;
+}
 
 bool CTxDB::LoadBlockIndexGuts()
 {
     // Get database cursor
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
-        return false;
+    CKeyValueCursor* pcursor = GetCursor(make_pair(string("blockindex"), uint256(0)));
 
     // Load mapBlockIndex
-    unsigned int fFlags = DB_SET_RANGE;
-    loop
+    for (; pcursor->Valid(); pcursor->Next())
     {
         // Read next record
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        if (fFlags == DB_SET_RANGE)
-            ssKey << make_pair(string("blockindex"), uint256(0));
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
-            return false;
+        string strKey = pcursor->GetKey();
+        string strValue = pcursor->GetValue();
+        CDataStream ssKey(strKey.data(), strKey.data() + strKey.size(), SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
 
         // Unserialize
 
@@ -684,24 +1432,14 @@ bool CTxDB::LoadBlockIndexGuts()
             ssValue >> diskindex;
 
             // Construct block index object
-            CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-            pindexNew->nFile          = diskindex.nFile;
-            pindexNew->nBlockPos      = diskindex.nBlockPos;
-            pindexNew->nHeight        = diskindex.nHeight;
-            pindexNew->nVersion       = diskindex.nVersion;
-            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-            pindexNew->nTime          = diskindex.nTime;
-            pindexNew->nBits          = diskindex.nBits;
-            pindexNew->nNonce         = diskindex.nNonce;
-
-            // Watch for genesis block
-            if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                pindexGenesisBlock = pindexNew;
+            CBlockIndex* pindexNew = LoadBlockIndexEntry(diskindex.GetBlockHash(), diskindex.hashPrev, diskindex);
+            pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
 
             if (!pindexNew->CheckIndex())
+            {
+                delete pcursor;
                 return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+            }
         }
         else
         {
@@ -709,15 +1447,278 @@ bool CTxDB::LoadBlockIndexGuts()
         }
         }    // try
         catch (std::exception &e) {
+            delete pcursor;
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
-    pcursor->close();
+    bool fCursorOk = pcursor->Ok();
+    delete pcursor;
+
+    return fCursorOk;
+}
+
+
+
+
+
+//
+// Block index snapshot
+//
+// A clean shutdown writes the whole block index to blkindex.snapshot in
+// height order, in chunks that each carry a checksum.  The next start reads
+// it instead of walking every record of blkindex.dat, and checks and decodes
+// the chunks on several threads.  The file is deleted as it is read, so it is
+// only ever trusted on the start right after the shutdown that wrote it.
+//
+
+static const int BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+static const unsigned int BLOCK_INDEX_SNAPSHOT_CHUNK = 4096;
+
+// An entry as kept in the snapshot: the hash it is stored under, and what
+// CDiskBlockIndex has except the successor, which follows from the best chain
+class CSnapshotBlockIndex : public CBlockIndex
+{
+public:
+    uint256 hashBlock;
+    uint256 hashPrev;
+
+    CSnapshotBlockIndex()
+    {
+        hashBlock = 0;
+        hashPrev = 0;
+    }
+
+    explicit CSnapshotBlockIndex(const CBlockIndex* pindex) : CBlockIndex(*pindex)
+    {
+        hashBlock = pindex->GetBlockHash();
+        hashPrev = (pprev ? pprev->GetBlockHash() : 0);
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(hashPrev);
+        READWRITE(nFile);
+        READWRITE(nBlockPos);
+        READWRITE(nHeight);
+        READWRITE(this->nVersion);
+        READWRITE(hashMerkleRoot);
+        READWRITE(nTime);
+        READWRITE(nBits);
+        READWRITE(nNonce);
+        READWRITE(hashPoW);
+    )
+};
+
+// Check one chunk against its checksum and decode it, run on a CCheckQueue
+class CSnapshotChunkCheck
+{
+public:
+    vector<char> vData;
+    uint256 hashData;
+    vector<CSnapshotBlockIndex>* pvEntries;
+
+    CSnapshotChunkCheck() : pvEntries(NULL) { }
+
+    bool operator()()
+    {
+        if (Hash(vData.begin(), vData.end()) != hashData)
+            return error("CSnapshotChunkCheck() : checksum mismatch");
+        try {
+            CDataStream ss(vData, SER_DISK, CLIENT_VERSION);
+            ss >> *pvEntries;
+        }
+        catch (std::exception &e) {
+            return error("CSnapshotChunkCheck() : deserialize error");
+        }
+        vector<char>().swap(vData);
+        return true;
+    }
+
+    void swap(CSnapshotChunkCheck& check)
+    {
+        vData.swap(check.vData);
+        std::swap(hashData, check.hashData);
+        std::swap(pvEntries, check.pvEntries);
+    }
+};
+
+static CCheckQueue<CSnapshotChunkCheck> snapshotcheckqueue(1);
+
+void static ThreadSnapshotCheck(void* parg)
+{
+    // Make this thread recognisable as a block index loading thread
+    RenameThread("bitcoin-loadidx");
+
+    try
+    {
+        snapshotcheckqueue.Thread();
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadSnapshotCheck()");
+    } catch (...) {
+        PrintException(NULL, "ThreadSnapshotCheck()");
+    }
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    int64 nStart = GetTimeMillis();
+    if (hashBestChain == 0 || !mapBlockIndex.count(hashBestChain))
+        return false;
+
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    boost::filesystem::path pathTmp = GetDataDir() / "blkindex.snapshot.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("WriteBlockIndexSnapshot() : open failed");
+
+    try {
+        fileout << BLOCK_INDEX_SNAPSHOT_VERSION << hashBestChain << (unsigned int)vSortedByHeight.size();
+        for (unsigned int i = 0; i < vSortedByHeight.size(); i += BLOCK_INDEX_SNAPSHOT_CHUNK)
+        {
+            unsigned int nEnd = min(i + BLOCK_INDEX_SNAPSHOT_CHUNK, (unsigned int)vSortedByHeight.size());
+            vector<CSnapshotBlockIndex> vEntries;
+            vEntries.reserve(nEnd - i);
+            for (unsigned int j = i; j < nEnd; j++)
+                vEntries.push_back(CSnapshotBlockIndex(vSortedByHeight[j].second));
+            CDataStream ss(SER_DISK, CLIENT_VERSION);
+            ss << vEntries;
+            vector<char> vData(ss.begin(), ss.end());
+            fileout << vData << Hash(vData.begin(), vData.end());
+        }
+    }
+    catch (std::exception &e) {
+        fileout.fclose();
+        boost::filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
 
+    if (!RenameOver(pathTmp, GetDataDir() / "blkindex.snapshot"))
+        return error("WriteBlockIndexSnapshot() : rename into place failed");
+    printf("WriteBlockIndexSnapshot() : wrote %u entries in %"PRI64d"ms\n", (unsigned int)vSortedByHeight.size(), GetTimeMillis() - nStart);
     return true;
 }
 
+// Read the entries of a snapshot taken at hashBestChainDB, when the database
+// held nCountDB entries, into mapBlockIndex, height ordered into
+// vSortedByHeight
+static bool ReadBlockIndexSnapshot(CAutoFile& filein, const uint256& hashBestChainDB, unsigned int nCountDB, vector<pair<int, CBlockIndex*> >& vSortedByHeight)
+{
+    int nSnapshotVersion = 0;
+    uint256 hashBestChainSnapshot;
+    unsigned int nEntries = 0;
+    try {
+        filein >> nSnapshotVersion >> hashBestChainSnapshot >> nEntries;
+    }
+    catch (std::exception &e) {
+        return error("LoadBlockIndexSnapshot() : I/O error");
+    }
+    if (nSnapshotVersion != BLOCK_INDEX_SNAPSHOT_VERSION)
+        return error("LoadBlockIndexSnapshot() : unknown version %d", nSnapshotVersion);
+    // Side branches can grow without the best chain changing
+    if (hashBestChainSnapshot != hashBestChainDB || nEntries != nCountDB)
+        return error("LoadBlockIndexSnapshot() : snapshot is stale");
+
+    mapBlockIndex.rehash(nEntries);
+    vSortedByHeight.reserve(nEntries);
+
+    // A few chunks per thread at a time, so that only those are held decoded
+    unsigned int nBatch = 4 * max(nVerifyThreads, 1);
+    unsigned int nRead = 0;
+    while (nRead < nEntries && !fRequestShutdown)
+    {
+        vector<vector<CSnapshotBlockIndex> > vvEntries(nBatch);
+        vector<CSnapshotChunkCheck> vChecks;
+        vector<unsigned int> vExpected;
+        try {
+            for (unsigned int i = 0; i < nBatch && nRead < nEntries; i++)
+            {
+                vChecks.push_back(CSnapshotChunkCheck());
+                CSnapshotChunkCheck& check = vChecks.back();
+                filein >> check.vData >> check.hashData;
+                check.pvEntries = &vvEntries[i];
+                vExpected.push_back(min(BLOCK_INDEX_SNAPSHOT_CHUNK, nEntries - nRead));
+                nRead += vExpected.back();
+            }
+        }
+        catch (std::exception &e) {
+            return error("LoadBlockIndexSnapshot() : I/O error");
+        }
+
+        CCheckQueueControl<CSnapshotChunkCheck> control(&snapshotcheckqueue);
+        control.Add(vChecks);
+        if (!control.Wait())
+            return false;
+
+        for (unsigned int i = 0; i < vExpected.size(); i++)
+        {
+            if (vvEntries[i].size() != vExpected[i])
+                return error("LoadBlockIndexSnapshot() : chunk has %u entries instead of %u", (unsigned int)vvEntries[i].size(), vExpected[i]);
+            BOOST_FOREACH(const CSnapshotBlockIndex& entry, vvEntries[i])
+            {
+                CBlockIndex* pindexNew = LoadBlockIndexEntry(entry.hashBlock, entry.hashPrev, entry);
+                if (!pindexNew->CheckIndex())
+                    return error("LoadBlockIndexSnapshot() : CheckIndex failed at %d", pindexNew->nHeight);
+                vSortedByHeight.push_back(make_pair(pindexNew->nHeight, pindexNew));
+            }
+            vector<CSnapshotBlockIndex>().swap(vvEntries[i]);
+        }
+    }
+    if (fRequestShutdown)
+        return false;
+
+    // pnext only runs along the best chain
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBestChainDB);
+    if (mi == mapBlockIndex.end())
+        return error("LoadBlockIndexSnapshot() : best chain not in the snapshot");
+    for (CBlockIndex* pindex = (*mi).second; pindex->pprev; pindex = pindex->pprev)
+        pindex->pprev->pnext = pindex;
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot(vector<pair<int, CBlockIndex*> >& vSortedByHeight)
+{
+    boost::filesystem::path path = GetDataDir() / "blkindex.snapshot";
+    FILE *file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
 
+    uint256 hashBestChainDB;
+    unsigned int nCountDB;
+    bool fOk = false;
+    if (ReadHashBestChain(hashBestChainDB) && ReadBlockIndexCount(nCountDB))
+    {
+        // The submitting thread does its share, so start one fewer
+        for (int i = 0; i < nVerifyThreads - 1; i++)
+            if (!CreateThread(ThreadSnapshotCheck, NULL))
+                printf("Error: CreateThread(ThreadSnapshotCheck) failed\n");
+        fOk = ReadBlockIndexSnapshot(filein, hashBestChainDB, nCountDB, vSortedByHeight);
+        snapshotcheckqueue.Quit();
+    }
+    filein.fclose();
+    boost::filesystem::remove(path);
+
+    // Don't leave the database walk a partly read snapshot to build on
+    if (!fOk)
+    {
+        BOOST_FOREACH(PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+            FreeBlockIndex(item.second);
+        mapBlockIndex.clear();
+        pindexGenesisBlock = NULL;
+        vSortedByHeight.clear();
+    }
+    return fOk;
+}
 
 
 
@@ -8,6 +8,7 @@
 #define BITCOIN_DB_H
 
 #include "main.h"
+#include "kvdb.h"
 
 #include <map>
 #include <string>
@@ -18,6 +19,8 @@
 class CAddress;
 class CAddrMan;
 class CBlockLocator;
+class CCoins;
+class CBlockUndo;
 class CDiskBlockIndex;
 class CDiskTxPos;
 class CMasterKey;
@@ -30,6 +33,7 @@ extern unsigned int nWalletDBUpdated;
 
 void ThreadFlushWalletDB(void* parg);
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
+void CloseChainDB();
 
 
 class CDBEnv
@@ -295,15 +299,127 @@ public:
 
 
 
-/** Access to the transaction database (blkindex.dat) */
-class CTxDB : public CDB
+/** Chain state kept in blkindex.dat, for builds without LevelDB and for
+ * importing an existing blkindex.dat into LevelDB.
+ */
+class CBerkeleyKeyValueDB : public CKeyValueDB, protected CDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    CBerkeleyKeyValueDB(const char* pszFile, const char* pszMode="cr+") : CDB(pszFile, pszMode) { }
+
+    bool Read(const std::string& key, std::string& value);
+    bool Exists(const std::string& key);
+    bool WriteBatch(const CKeyValueBatch& batch);
+    CKeyValueCursor* NewCursor();
+};
+
+
+/** Access to the transaction database: transaction positions, unspent
+ * outputs and the block index.  Stored by LevelDB in txleveldb/, or in
+ * blkindex.dat for builds without USE_LEVELDB.  Writes made between
+ * TxnBegin() and TxnCommit() are kept in this object, seen by its own
+ * reads, and applied to the store in one atomic batch on commit.
+ */
+class CTxDB
+{
+public:
+    CTxDB(const char* pszMode="r+");
+    ~CTxDB() { Close(); }
+    void Close();
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+
+    CKeyValueDB* pdb;
+    bool fReadOnly;
+    bool fTxn;
+    CKeyValueBatch batch;
+
+    template<typename K>
+    static std::string SerializeKey(const K& key)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+        return ssKey.str();
+    }
+
+    bool ReadRaw(const std::string& key, std::string& value);
+    bool WriteRaw(const std::string& key, const std::string& value);
+    bool EraseRaw(const std::string& key);
+
+protected:
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        std::string strValue;
+        if (!ReadRaw(SerializeKey(key), strValue))
+            return false;
+
+        // Unserialize value
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> value;
+        }
+        catch (std::exception &e) {
+            return false;
+        }
+        return true;
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value)
+    {
+        if (fReadOnly)
+            assert(!"Write called on database in read-only mode");
+
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.reserve(10000);
+        ssValue << value;
+        return WriteRaw(SerializeKey(key), ssValue.str());
+    }
+
+    template<typename K>
+    bool Erase(const K& key)
+    {
+        if (fReadOnly)
+            assert(!"Erase called on database in read-only mode");
+        return EraseRaw(SerializeKey(key));
+    }
+
+    template<typename K>
+    bool Exists(const K& key)
+    {
+        std::string strValue;
+        return ReadRaw(SerializeKey(key), strValue);
+    }
+
+    // Cursor positioned at the first record not below key; caller deletes it.
+    // Does not see writes of an uncommitted transaction.
+    template<typename K>
+    CKeyValueCursor* GetCursor(const K& key)
+    {
+        CKeyValueCursor* pcursor = pdb->NewCursor();
+        pcursor->Seek(SerializeKey(key));
+        return pcursor;
+    }
+
 public:
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
+
+    bool ReadVersion(int& nVersion)
+    {
+        nVersion = 0;
+        return Read(std::string("version"), nVersion);
+    }
+
+    bool WriteVersion(int nVersion)
+    {
+        return Write(std::string("version"), nVersion);
+    }
+
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
@@ -313,19 +429,36 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadCoins(uint256 hash, CCoins& coins);
+    bool WriteCoins(uint256 hash, const CCoins& coins);
+    bool EraseCoins(uint256 hash);
+    bool HaveCoins(uint256 hash);
+    bool ReadBestCoins(uint256& hashBestCoins);
+    bool WriteBestCoins(uint256 hashBestCoins);
+    bool ReadBlockUndo(uint256 hashBlock, CBlockUndo& blockundo);
+    bool WriteBlockUndo(uint256 hashBlock, const CBlockUndo& blockundo);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
-    bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
-    bool WriteBestInvalidWork(CBigNum bnBestInvalidWork);
+    bool ReadBestInvalidWork(uint256& nBestInvalidWork);
+    bool WriteBestInvalidWork(const uint256& nBestInvalidWork);
+    bool ReadBlockIndexCount(unsigned int& nCount);
+    bool WriteBlockIndexCount(unsigned int nCount);
     bool LoadBlockIndex();
 private:
+    bool LoadBlockIndexSnapshot(std::vector<std::pair<int, CBlockIndex*> >& vSortedByHeight);
     bool LoadBlockIndexGuts();
+    bool BuildCoinsFromTxIndex();
 };
 
 
 
 
+bool WriteBlockIndexSnapshot();
+void ThreadVerifyBlocks(void* parg);
+void StopVerifyBlocks();
+
+
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
 {
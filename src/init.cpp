@@ -11,6 +11,7 @@
 #include "init.h"
 #include "util.h"
 #include "ui_interface.h"
+#include "scrypt.h"
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/convenience.hpp>
@@ -74,7 +75,16 @@ void Shutdown(void* parg)
         fShutdown = true;
         nTransactionsUpdated++;
         bitdb.Flush(false);
+        StopPoWCheckThreads();
+        StopScriptCheckThreads();
+        StopVerifyBlocks();
         StopNode();
+        {
+            LOCK(cs_main);
+            FlushCoinsCache(true);
+            WriteBlockIndexSnapshot();
+        }
+        CloseChainDB();
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -223,7 +233,9 @@ std::string HelpMessage()
         "  -gen                   " + _("Generate coins") + "\n" +
         "  -gen=0                 " + _("Don't generate coins") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
-        "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -dbcache=<n>           " + _("Set database and unspent output cache size in megabytes (default: 100)") + "\n" +
+        "  -maxsigcachemb=<n>     " + _("Limit the signature cache to <n> megabytes (default: 10)") + "\n" +
+        "  -maxsigcachesize=<n>   " + _("Limit the signature cache to <n> entries (deprecated, use -maxsigcachemb)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout (in milliseconds)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
@@ -232,6 +244,7 @@ std::string HelpMessage()
         "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n" +
         "  -port=<port>           " + _("Listen for connections on <port> (default: 9558 or testnet: 19558)") + "\n" +
         "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
+        "  -msgthreads=<n>        " + _("Set the number of threads processing messages from peers (1-16, default: 2)") + "\n" +
         "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
         "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n" +
         "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n" +
@@ -246,6 +259,8 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 100)") + "\n" +
+        "  -maxblockcache=<n>     " + _("Keep recently requested blocks ready to send to peers, up to <n>*1000 bytes (default: 8000)") + "\n" +
         "  -setmaxheightaccepted=<n>" +_("Any peer connecting that reports over this number of blocks will be disconnected") + "\n" +
 
 #ifdef USE_UPNP
@@ -278,12 +293,14 @@ std::string HelpMessage()
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
+        "  -blocknotifyudp=<ip:port> " + _("Send the block hash in a UDP datagram to <ip:port> when the best block changes") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
-        "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
+        "  -checkblocks=<n>       " + _("How many blocks to check after startup, in the background (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
+        "  -par=<n>               " + _("Set the number of proof-of-work and script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
         "  -?, --help             " + _("This help message") + "\n";
 
     strUsage += string() +
@@ -380,6 +397,20 @@ bool AppInit2()
 
     bitdb.SetDetach(GetBoolArg("-detachdb", false));
 
+    nVerifyThreads = GetArg("-par", 0);
+    if (nVerifyThreads <= 0)
+        nVerifyThreads += boost::thread::hardware_concurrency();
+    if (nVerifyThreads < 1)
+        nVerifyThreads = 1;
+    else if (nVerifyThreads > MAX_VERIFY_THREADS)
+        nVerifyThreads = MAX_VERIFY_THREADS;
+
+    InitSignatureCache();
+
+    // A quarter of -dbcache goes to BerkeleyDB, the rest to the coin cache
+    int64 nTotalCache = std::max((int64)4, GetArg("-dbcache", 100));
+    nCoinCacheSize = (nTotalCache - nTotalCache / 4) << 20;
+
 #if !defined(WIN32) && !defined(QT_GUI)
     fDaemon = GetBoolArg("-daemon");
 #else
@@ -587,6 +618,11 @@ bool AppInit2()
 
     // ********************************************************* Step 6: load blockchain
 
+    // Pick the scrypt kernel once, before any thread that hashes starts
+    printf("Using %d-way scrypt\n", scrypt_best_throughput());
+    StartPoWCheckThreads();
+    StartScriptCheckThreads();
+
     if (GetBoolArg("-loadblockindextest"))
     {
         CTxDB txdb("r");
@@ -621,7 +657,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -765,6 +801,10 @@ bool AppInit2()
     if (fServer)
         CreateThread(ThreadRPCServer, NULL);
 
+    // Check the last -checkblocks blocks while already serving
+    if (!CreateThread(ThreadVerifyBlocks, NULL))
+        printf("Error: CreateThread(ThreadVerifyBlocks) failed\n");
+
     // ********************************************************* Step 11: finished
 
     uiInterface.InitMessage(_("Done loading"));
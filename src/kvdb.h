@@ -0,0 +1,59 @@
+// Copyright (c) 2013 Sexcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_KVDB_H
+#define BITCOIN_KVDB_H
+
+#include <map>
+#include <string>
+#include <utility>
+
+/** A set of writes applied to a CKeyValueDB all at once.  A later write to
+ * the same key replaces an earlier one.
+ */
+class CKeyValueBatch
+{
+public:
+    // key -> (fErase, value)
+    typedef std::map<std::string, std::pair<bool, std::string> > writemap_type;
+    writemap_type mapWrites;
+
+    void Write(const std::string& key, const std::string& value) { mapWrites[key] = std::make_pair(false, value); }
+    void Erase(const std::string& key) { mapWrites[key] = std::make_pair(true, std::string()); }
+    unsigned int size() const { return mapWrites.size(); }
+    void clear() { mapWrites.clear(); }
+};
+
+/** Forward iterator over the records of a CKeyValueDB, in key order */
+class CKeyValueCursor
+{
+public:
+    virtual ~CKeyValueCursor() { }
+
+    // Move to the first record with a key not less than key
+    virtual void Seek(const std::string& key) = 0;
+    virtual void Next() = 0;
+    // False at the end, or after an error
+    virtual bool Valid() const = 0;
+    // False if iteration stopped because of an error
+    virtual bool Ok() const = 0;
+    virtual std::string GetKey() const = 0;
+    virtual std::string GetValue() const = 0;
+};
+
+/** Storage engine under CTxDB: an ordered key-value store with atomic
+ * batch writes.  Keys compare bytewise.  Implementations are thread safe.
+ */
+class CKeyValueDB
+{
+public:
+    virtual ~CKeyValueDB() { }
+
+    virtual bool Read(const std::string& key, std::string& value) = 0;
+    virtual bool Exists(const std::string& key) = 0;
+    virtual bool WriteBatch(const CKeyValueBatch& batch) = 0;
+    // Caller deletes the cursor
+    virtual CKeyValueCursor* NewCursor() = 0;
+};
+
+#endif
@@ -0,0 +1,102 @@
+// Copyright (c) 2013 Sexcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "leveldb.h"
+#include "util.h"
+
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+
+class CLevelDBCursor : public CKeyValueCursor
+{
+private:
+    leveldb::Iterator* piter;
+
+public:
+    CLevelDBCursor(leveldb::Iterator* piterIn) : piter(piterIn) { }
+    ~CLevelDBCursor() { delete piter; }
+
+    void Seek(const std::string& key) { piter->Seek(key); }
+    void Next() { piter->Next(); }
+    bool Valid() const { return piter->Valid(); }
+    bool Ok() const { return piter->status().ok(); }
+    std::string GetKey() const { return piter->key().ToString(); }
+    std::string GetValue() const { return piter->value().ToString(); }
+};
+
+
+CLevelDB::CLevelDB(const boost::filesystem::path& path, size_t nCacheSize) : pdb(NULL)
+{
+    // Keys and values are mostly hashes, which don't compress
+    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
+    options.write_buffer_size = nCacheSize / 4;
+    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    options.compression = leveldb::kNoCompression;
+    options.max_open_files = 64;
+    options.create_if_missing = true;
+    readoptions.verify_checksums = true;
+    writeoptions.sync = false;
+
+    boost::filesystem::create_directory(path);
+    printf("Opening LevelDB in %s\n", path.string().c_str());
+    leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
+    if (!status.ok())
+    {
+        delete options.filter_policy;
+        delete options.block_cache;
+        throw runtime_error(strprintf("CLevelDB() : error opening database environment %s", status.ToString().c_str()));
+    }
+}
+
+CLevelDB::~CLevelDB()
+{
+    delete pdb;
+    pdb = NULL;
+    delete options.filter_policy;
+    options.filter_policy = NULL;
+    delete options.block_cache;
+    options.block_cache = NULL;
+}
+
+bool CLevelDB::Read(const std::string& key, std::string& value)
+{
+    leveldb::Status status = pdb->Get(readoptions, key, &value);
+    if (status.IsNotFound())
+        return false;
+    if (!status.ok())
+        return error("CLevelDB::Read() : %s", status.ToString().c_str());
+    return true;
+}
+
+bool CLevelDB::Exists(const std::string& key)
+{
+    std::string value;
+    return Read(key, value);
+}
+
+bool CLevelDB::WriteBatch(const CKeyValueBatch& batch)
+{
+    leveldb::WriteBatch writebatch;
+    for (CKeyValueBatch::writemap_type::const_iterator mi = batch.mapWrites.begin(); mi != batch.mapWrites.end(); ++mi)
+    {
+        if ((*mi).second.first)
+            writebatch.Delete((*mi).first);
+        else
+            writebatch.Put((*mi).first, (*mi).second.second);
+    }
+    leveldb::Status status = pdb->Write(writeoptions, &writebatch);
+    if (!status.ok())
+        return error("CLevelDB::WriteBatch() : %s", status.ToString().c_str());
+    return true;
+}
+
+CKeyValueCursor* CLevelDB::NewCursor()
+{
+    return new CLevelDBCursor(pdb->NewIterator(readoptions));
+}
@@ -0,0 +1,40 @@
+// Copyright (c) 2013 Sexcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_LEVELDB_H
+#define BITCOIN_LEVELDB_H
+
+#include "kvdb.h"
+
+#include <boost/filesystem/path.hpp>
+
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+
+/** Chain state storage in a LevelDB directory.  Writes are not synced,
+ * like the BerkeleyDB environment's DB_TXN_WRITE_NOSYNC; a crash of the
+ * process loses nothing, a crash of the machine may lose the last writes.
+ */
+class CLevelDB : public CKeyValueDB
+{
+private:
+    leveldb::Options options;
+    leveldb::ReadOptions readoptions;
+    leveldb::WriteOptions writeoptions;
+    leveldb::DB* pdb;
+
+    CLevelDB(const CLevelDB&);
+    void operator=(const CLevelDB&);
+
+public:
+    // Throws runtime_error if the database cannot be opened
+    CLevelDB(const boost::filesystem::path& path, size_t nCacheSize);
+    ~CLevelDB();
+
+    bool Read(const std::string& key, std::string& value);
+    bool Exists(const std::string& key);
+    bool WriteBatch(const CKeyValueBatch& batch);
+    CKeyValueCursor* NewCursor();
+};
+
+#endif
@@ -7,6 +7,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "net.h"
 #include "init.h"
@@ -33,22 +34,38 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+CBlockIndexMap mapBlockIndex;
 uint256 hashGenesisBlock("0xf42b9553085a1af63d659d3907a42c3a0052bbfa2693d3acf990af85755f2279");
-static CBigNum bnProofOfWorkLimit(~uint256(0) >> 5); // sexcoin: starting difficulty is 1 / 2^12
+static const uint256 hashProofOfWorkLimit(~uint256(0) >> 5); // sexcoin: starting difficulty is 1 / 2^12
+static CBigNum bnProofOfWorkLimit(hashProofOfWorkLimit);
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 int nMaxHeightAccepted = 9999999;
-CBigNum bnBestChainWork = 0;
-CBigNum bnBestInvalidWork = 0;
+uint256 nBestChainWork = 0;
+uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
+// The best chain, by height
+static vector<CBlockIndex*> vMainChain;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
 
-map<uint256, CBlock*> mapOrphanBlocks;
-multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
+boost::unordered_map<uint256, CBlock*, CSaltedHasher> mapOrphanBlocks;
+boost::unordered_multimap<uint256, CBlock*, CSaltedHasher> mapOrphanBlocksByPrev;
+
+// Headers-first sync: validated headers whose blocks we don't have yet.  An
+// entry moves to mapBlockIndex when its block is accepted.
+CBlockIndexMap mapHeaderIndex;
+CBlockIndex* pindexBestHeader = NULL;
+static int64 nTimeBestHeader = 0;
+// The chain ending in pindexBestHeader, by height
+static vector<CBlockIndex*> vHeaderChain;
+// Blocks requested for headers-first sync: hash -> (peer, time requested)
+static map<uint256, pair<CNode*, int64> > mapBlocksInFlight;
+
+static void SetBestHeader(CBlockIndex* pindexNew);
+static void PruneHeaders(CBlockIndex* pindexBad);
 
 map<uint256, CDataStream*> mapOrphanTransactions;
 map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
@@ -64,6 +81,11 @@ int64 nHPSTimerStart;
 // Settings
 int64 nTransactionFee = 0;
 int64 nMinimumInputValue = CENT / 100;
+int nVerifyThreads = 0;
+int64 nCoinCacheSize = 75 << 20;
+
+// Write cached coins out at least this often (seconds), even under budget
+static const int64 COINS_FLUSH_INTERVAL = 10 * 60;
 
 
 
@@ -417,7 +439,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -481,6 +503,25 @@ bool CTransaction::CheckTransaction() const
     return true;
 }
 
+// Fill in the fee of a pool entry and the priority and value of its inputs
+// already in the chain
+static void SetEntryInputs(const CTransaction& tx, const MapPrevTx& mapInputs, CTxMemPoolEntry& entry)
+{
+    entry.nFee = tx.GetValueIn(mapInputs) - tx.GetValueOut();
+    entry.dPriority = 0;
+    entry.nValueInChain = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const CCoins& coins = (*mapInputs.find(txin.prevout.hash)).second;
+        if (coins.nHeight == MEMPOOL_HEIGHT)
+            continue;
+        int64 nValueIn = coins.vout[txin.prevout.n].nValue;
+        entry.dPriority += (double)nValueIn * (entry.nHeight - coins.nHeight + 1);
+        entry.nValueInChain += nValueIn;
+    }
+    entry.dPriority /= entry.nTxSize;
+}
+
 bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
                         bool* pfMissingInputs)
 {
@@ -541,12 +582,16 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         }
     }
 
+    CTxMemPoolEntry entry;
+    entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    entry.nHeight = nBestHeight;
+
     if (fCheckInputs)
     {
         MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
+        CCoinsCache view(txdb);
         bool fInvalid = false;
-        if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+        if (!tx.FetchInputs(view, false, false, mapInputs, fInvalid))
         {
             if (fInvalid)
                 return error("CTxMemPool::accept() : FetchInputs found invalid tx %s", hash.ToString().substr(0,10).c_str());
@@ -564,12 +609,18 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         // reasonable number of ECDSA signature verifications.
 
         int64 nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        unsigned int nSize = entry.nTxSize;
 
         // Don't accept it if it can't get into a block
         if (nFees < tx.GetMinFee(1000, true, GMF_RELAY))
             return error("CTxMemPool::accept() : not enough fees");
 
+        // Nor if the pool has been full of better paying ones lately.  The
+        // wallet pays this already; it is let through in case the floor rose
+        // after it made the transaction, as its coins are spent by then.
+        if (nFees < GetMinFee(nSize) && !IsFromMe(tx))
+            return error("CTxMemPool::accept() : mempool min fee not met, %"PRI64d" < %"PRI64d, nFees, GetMinFee(nSize));
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make other's transactions take longer to confirm.
@@ -597,10 +648,28 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false))
+        if (!tx.ConnectInputs(mapInputs, view, pindexBest, false, false))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
+        entry.fScriptsChecked = true;
+
+        // Work out what block creation will want to know, once
+        SetEntryInputs(tx, mapInputs, entry);
+    }
+    else if (!fClient)
+    {
+        // Not checked (a reorganization putting it back, or a wallet
+        // transaction), but it's ranked by fee and priority all the same
+        MapPrevTx mapInputs;
+        CCoinsCache view(txdb);
+        bool fInvalid = false;
+        bool fAvailable = tx.FetchInputs(view, false, false, mapInputs, fInvalid);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (fAvailable && !mapInputs[txin.prevout.hash].IsAvailable(txin.prevout.n))
+                fAvailable = false;
+        if (fAvailable)
+            SetEntryInputs(tx, mapInputs, entry);
     }
 
     // Store transaction in memory
@@ -611,7 +680,10 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, tx, entry);
+        LimitSize(GetArg("-maxmempool", 100) * 1000000);
+        if (!exists(hash))
+            return error("CTxMemPool::accept() : mempool full");
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -630,7 +702,26 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     return mempool.accept(txdb, *this, fCheckInputs, pfMissingInputs);
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+// Heap memory of one link between a pool transaction and its parent or
+// child: a node in setDepends or setSpentBy
+static const size_t MEMPOOL_LINK_USAGE = sizeof(uint256) + 4 * sizeof(void*);
+
+// Rough heap memory a pool transaction holds, counting its nodes in the
+// pool's maps and sets.  Its links are added as they are made.
+static size_t GetMemPoolUsage(const CTransaction& tx)
+{
+    const size_t nNodeOverhead = 4 * sizeof(void*);
+    size_t nUsage = sizeof(CTransaction) + sizeof(CTxMemPoolEntry) + 3 * (sizeof(uint256) + nNodeOverhead);
+    nUsage += sizeof(CTxMemPoolRank) + nNodeOverhead;
+    nUsage += tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity() + sizeof(COutPoint) + sizeof(CInPoint) + nNodeOverhead;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entryIn)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
@@ -638,8 +729,45 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+
+        // Link it to its parents and to any children already here, which
+        // happens when a reorganization puts it back
+        CTxMemPoolEntry& entry = mapEntry[hash];
+        entry = entryIn;
+        entry.setDepends.clear();
+        entry.setSpentBy.clear();
+        entry.nUsage = GetMemPoolUsage(tx);
+        nUsage += entry.nUsage;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            entrymap_type::iterator mi = mapEntry.find(txin.prevout.hash);
+            if (mi != mapEntry.end() && entry.setDepends.insert(txin.prevout.hash).second)
+            {
+                CTxMemPoolEntry& parent = (*mi).second;
+                parent.setSpentBy.insert(hash);
+                entry.nUsage += MEMPOOL_LINK_USAGE;
+                parent.nUsage += MEMPOOL_LINK_USAGE;
+                nUsage += 2 * MEMPOOL_LINK_USAGE;
+            }
+        }
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            nexttxmap_type::iterator mi = mapNextTx.find(COutPoint(hash, i));
+            if (mi == mapNextTx.end())
+                continue;
+            uint256 hashChild = (*mi).second.ptx->GetHash();
+            if (!entry.setSpentBy.insert(hashChild).second)
+                continue;
+            CTxMemPoolEntry& child = mapEntry[hashChild];
+            child.setDepends.insert(hash);
+            entry.nUsage += MEMPOOL_LINK_USAGE;
+            child.nUsage += MEMPOOL_LINK_USAGE;
+            nUsage += 2 * MEMPOOL_LINK_USAGE;
+        }
+        setRank.insert(CTxMemPoolRank(hash, entry));
         nTransactionsUpdated++;
     }
+    NotifyNewWork();
     return true;
 }
 
@@ -654,6 +782,30 @@ bool CTxMemPool::remove(CTransaction &tx)
         {
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
+
+            entrymap_type::iterator mi = mapEntry.find(hash);
+            if (mi != mapEntry.end())
+            {
+                // Its own links go with its nUsage, the other ends here
+                CTxMemPoolEntry& entry = (*mi).second;
+                BOOST_FOREACH(const uint256& hashParent, entry.setDepends)
+                {
+                    CTxMemPoolEntry& parent = mapEntry[hashParent];
+                    parent.setSpentBy.erase(hash);
+                    parent.nUsage -= MEMPOOL_LINK_USAGE;
+                    nUsage -= MEMPOOL_LINK_USAGE;
+                }
+                BOOST_FOREACH(const uint256& hashChild, entry.setSpentBy)
+                {
+                    CTxMemPoolEntry& child = mapEntry[hashChild];
+                    child.setDepends.erase(hash);
+                    child.nUsage -= MEMPOOL_LINK_USAGE;
+                    nUsage -= MEMPOOL_LINK_USAGE;
+                }
+                setRank.erase(CTxMemPoolRank(hash, entry));
+                nUsage -= entry.nUsage;
+                mapEntry.erase(mi);
+            }
             mapTx.erase(hash);
             nTransactionsUpdated++;
         }
@@ -661,13 +813,106 @@ bool CTxMemPool::remove(CTransaction &tx)
     return true;
 }
 
+// Take the transactions of a block that joined the best chain at
+// nBlockHeight out of the pool.  Outputs of theirs spent in the pool are
+// chain inputs now, and add to their spenders' priority from here on.
+void CTxMemPool::removeForBlock(std::vector<CTransaction>& vtx, int nBlockHeight)
+{
+    LOCK(cs);
+    BOOST_FOREACH(CTransaction& tx, vtx)
+    {
+        uint256 hash = tx.GetHash();
+        entrymap_type::iterator mi = mapEntry.find(hash);
+        if (mi != mapEntry.end())
+        {
+            BOOST_FOREACH(const uint256& hashChild, (*mi).second.setSpentBy)
+            {
+                int64 nValueIn = 0;
+                BOOST_FOREACH(const CTxIn& txin, mapTx[hashChild].vin)
+                    if (txin.prevout.hash == hash && txin.prevout.n < tx.vout.size())
+                        nValueIn += tx.vout[txin.prevout.n].nValue;
+                if (nValueIn == 0)
+                    continue;
+
+                // GetPriority() ages nValueInChain from the child's entry
+                // height; this part only ages from nBlockHeight
+                CTxMemPoolEntry& child = mapEntry[hashChild];
+                setRank.erase(CTxMemPoolRank(hashChild, child));
+                child.dPriority += (double)nValueIn * (child.nHeight - nBlockHeight + 1) / child.nTxSize;
+                child.nValueInChain += nValueIn;
+                setRank.insert(CTxMemPoolRank(hashChild, child));
+            }
+        }
+        remove(tx);
+    }
+}
+
+// The fee a transaction of nBytes needs to get in.  Raised whenever
+// LimitSize evicts, then halves every 12 hours.
+int64 CTxMemPool::GetMinFee(unsigned int nBytes)
+{
+    LOCK(cs);
+    if (dMinFeeRate == 0)
+        return 0;
+    int64 nNow = GetTime();
+    if (nNow > nMinFeeRateTime)
+    {
+        dMinFeeRate *= pow(0.5, (double)(nNow - nMinFeeRateTime) / (12 * 60 * 60));
+        nMinFeeRateTime = nNow;
+        if (dMinFeeRate < MIN_RELAY_TX_FEE / 2)
+            dMinFeeRate = 0;
+    }
+    return (int64)(dMinFeeRate * nBytes / 1000);
+}
+
+// Evict the lowest fee rate transactions, each with everything in the pool
+// that spends from it, until the pool fits in nMaxUsage bytes
+void CTxMemPool::LimitSize(size_t nMaxUsage)
+{
+    LOCK(cs);
+    while (nUsage > nMaxUsage && !setRank.empty())
+    {
+        // The worst one and its descendants go together; nothing mines a
+        // child without its parent
+        vector<uint256> vPackage;
+        vPackage.push_back((*setRank.rbegin()).hash);
+        set<uint256> setPackage(vPackage.begin(), vPackage.end());
+        int64 nPackageFees = 0;
+        unsigned int nPackageSize = 0;
+        for (unsigned int i = 0; i < vPackage.size(); i++)
+        {
+            const CTxMemPoolEntry& entry = mapEntry[vPackage[i]];
+            nPackageFees += max(entry.nFee, (int64)0);
+            nPackageSize += entry.nTxSize;
+            BOOST_FOREACH(const uint256& hashChild, entry.setSpentBy)
+                if (setPackage.insert(hashChild).second)
+                    vPackage.push_back(hashChild);
+        }
+
+        // Whatever comes in next has to beat it
+        double dPackageFeeRate = (double)nPackageFees * 1000 / nPackageSize;
+        GetMinFee(0); // apply the decay so far
+        if (dPackageFeeRate + MIN_RELAY_TX_FEE > dMinFeeRate)
+            dMinFeeRate = dPackageFeeRate + MIN_RELAY_TX_FEE;
+        nMinFeeRateTime = GetTime();
+
+        printf("CTxMemPool::LimitSize() : evicting %u transactions from %s, fee rate %.0f\n",
+               (unsigned int)vPackage.size(), vPackage[0].ToString().substr(0,10).c_str(), dPackageFeeRate);
+        BOOST_FOREACH(const uint256& hash, vPackage)
+        {
+            CTransaction tx = mapTx[hash];
+            remove(tx);
+        }
+    }
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (txmap_type::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
@@ -680,7 +925,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -756,20 +1001,274 @@ bool CWalletTx::AcceptWalletTransaction()
     return AcceptWalletTransaction(txdb);
 }
 
-int CTxIndex::GetDepthInMainChain() const
+int CTxIndex::GetHeightInMainChain() const
 {
     // Read block header
     CBlock block;
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
-        return 0;
+        return -1;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
-        return 0;
+        return -1;
     CBlockIndex* pindex = (*mi).second;
     if (!pindex || !pindex->IsInMainChain())
+        return -1;
+    return pindex->nHeight;
+}
+
+int CTxIndex::GetDepthInMainChain() const
+{
+    int nHeight = GetHeightInMainChain();
+    if (nHeight < 0)
         return 0;
-    return 1 + nBestHeight - pindex->nHeight;
+    return 1 + nBestHeight - nHeight;
+}
+
+
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// CCoinsCache
+//
+
+CCoinsCache coinsTip;
+
+// Rough heap cost of a cache entry, for the -dbcache budget
+static int64 GetCoinsMemoryUsage(const CCoins& coins)
+{
+    int64 nUsage = sizeof(uint256) + sizeof(CCoins) + 4 * sizeof(void*) + coins.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxOut& txout, coins.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
+}
+
+CCoinsCache::CCoinsCache(CTxDB& txdbIn) : pbase(&coinsTip), ptxdb(&txdbIn), hashBlock(0), nMemoryUsage(0)
+{
+}
+
+void CCoinsCache::Store(const uint256& txid, const CCoins& coins, bool fDirty)
+{
+    entrymap_type::iterator mi = cacheCoins.find(txid);
+    if (mi == cacheCoins.end())
+        mi = cacheCoins.insert(make_pair(txid, CEntry())).first;
+    else
+        nMemoryUsage -= GetCoinsMemoryUsage(mi->second.coins);
+    mi->second.coins = coins;
+    mi->second.fDirty = fDirty;
+    nMemoryUsage += GetCoinsMemoryUsage(coins);
+}
+
+CCoinsCache::entrymap_type::iterator CCoinsCache::FetchCoins(const uint256& txid, CTxDB& txdb)
+{
+    entrymap_type::iterator mi = cacheCoins.find(txid);
+    if (mi != cacheCoins.end())
+        return mi;
+
+    CCoins coins;
+    if (pbase)
+    {
+        entrymap_type::iterator miBase = pbase->FetchCoins(txid, txdb);
+        if (miBase == pbase->cacheCoins.end())
+            return cacheCoins.end();
+        coins = miBase->second.coins;
+    }
+    else if (!txdb.ReadCoins(txid, coins))
+        return cacheCoins.end();
+
+    Store(txid, coins, false);
+    return cacheCoins.find(txid);
+}
+
+bool CCoinsCache::GetCoins(const uint256& txid, CCoins& coins)
+{
+    assert(ptxdb);
+    entrymap_type::iterator mi = FetchCoins(txid, *ptxdb);
+    if (mi == cacheCoins.end() || mi->second.coins.IsPruned())
+        return false;
+    coins = mi->second.coins;
+    return true;
+}
+
+void CCoinsCache::SetCoins(const uint256& txid, const CCoins& coins)
+{
+    Store(txid, coins, true);
+}
+
+bool CCoinsCache::HaveCoins(const uint256& txid)
+{
+    assert(ptxdb);
+    entrymap_type::iterator mi = FetchCoins(txid, *ptxdb);
+    return (mi != cacheCoins.end() && !mi->second.coins.IsPruned());
+}
+
+bool CCoinsCache::Flush()
+{
+    assert(pbase);
+    for (entrymap_type::iterator mi = cacheCoins.begin(); mi != cacheCoins.end(); ++mi)
+        if (mi->second.fDirty)
+            pbase->SetCoins(mi->first, mi->second.coins);
+    cacheCoins.clear();
+    nMemoryUsage = 0;
+    return true;
+}
+
+bool CCoinsCache::WriteToDisk(CTxDB& txdb, bool fClear)
+{
+    assert(!pbase);
+
+    // Write in batches to stay within BerkeleyDB's lock table, and tag the
+    // last batch with the best block.  After a crash in between, the records
+    // are partly ahead of the tag; ReplayCoins() only sets absolute values,
+    // so replaying from the tag still ends in the right state.
+    const unsigned int nBatch = 1000;
+    unsigned int nWritten = 0;
+    entrymap_type::iterator mi = cacheCoins.begin();
+    do
+    {
+        if (!txdb.TxnBegin())
+            return error("CCoinsCache::WriteToDisk() : TxnBegin failed");
+        for (unsigned int n = 0; mi != cacheCoins.end() && n < nBatch; ++mi)
+        {
+            if (!mi->second.fDirty)
+                continue;
+            bool fOk = mi->second.coins.IsPruned() ? txdb.EraseCoins(mi->first) : txdb.WriteCoins(mi->first, mi->second.coins);
+            if (!fOk)
+            {
+                txdb.TxnAbort();
+                return error("CCoinsCache::WriteToDisk() : writing coins failed");
+            }
+            n++;
+            nWritten++;
+        }
+        if (mi == cacheCoins.end() && hashBlock != 0 && !txdb.WriteBestCoins(hashBlock))
+        {
+            txdb.TxnAbort();
+            return error("CCoinsCache::WriteToDisk() : WriteBestCoins failed");
+        }
+        if (!txdb.TxnCommit())
+            return error("CCoinsCache::WriteToDisk() : TxnCommit failed");
+    } while (mi != cacheCoins.end());
+
+    if (fClear)
+    {
+        cacheCoins.clear();
+        nMemoryUsage = 0;
+    }
+    else
+    {
+        // Keep what is still unspent, now clean
+        for (mi = cacheCoins.begin(); mi != cacheCoins.end(); )
+        {
+            if (mi->second.coins.IsPruned())
+            {
+                nMemoryUsage -= GetCoinsMemoryUsage(mi->second.coins);
+                cacheCoins.erase(mi++);
+            }
+            else
+            {
+                mi->second.fDirty = false;
+                ++mi;
+            }
+        }
+    }
+
+    if (fDebug)
+        printf("CCoinsCache::WriteToDisk() : wrote %u coin records\n", nWritten);
+    return true;
+}
+
+bool FlushCoinsCache(bool fForce)
+{
+    static int64 nLastFlush = GetTime();
+
+    int64 nNow = GetTime();
+    bool fOverBudget = coinsTip.GetMemoryUsage() > nCoinCacheSize;
+    if (!fForce && !fOverBudget && nNow < nLastFlush + COINS_FLUSH_INTERVAL)
+        return true;
+
+    int64 nStart = GetTimeMillis();
+    unsigned int nEntries = coinsTip.GetCacheSize();
+    CTxDB txdb;
+    if (!coinsTip.WriteToDisk(txdb, fOverBudget))
+        return false;
+    nLastFlush = nNow;
+    printf("FlushCoinsCache() : flushed %u cached coin records in %"PRI64d"ms\n", nEntries, GetTimeMillis() - nStart);
+    return true;
+}
+
+// Bring the coin database from pindexCoins, the block it was last known
+// consistent with, to the best chain after the coin cache was lost
+bool ReplayCoins(CBlockIndex* pindexCoins)
+{
+    printf("ReplayCoins() : coin database at %s, best chain at %s\n",
+      pindexCoins->GetBlockHash().ToString().substr(0,20).c_str(), hashBestChain.ToString().substr(0,20).c_str());
+
+    // Find the fork
+    CBlockIndex* pfork = pindexCoins;
+    CBlockIndex* plonger = pindexBest;
+    while (pfork != plonger)
+    {
+        while (plonger->nHeight > pfork->nHeight)
+            if (!(plonger = plonger->pprev))
+                return error("ReplayCoins() : plonger->pprev is null");
+        if (pfork == plonger)
+            break;
+        if (!(pfork = pfork->pprev))
+            return error("ReplayCoins() : pfork->pprev is null");
+    }
+
+    CTxDB txdb("r");
+    CCoinsCache view(txdb);
+
+    // Roll back blocks that are no longer in the best chain
+    for (CBlockIndex* pindex = pindexCoins; pindex != pfork; pindex = pindex->pprev)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("ReplayCoins() : ReadFromDisk for disconnect failed");
+        CBlockUndo blockundo;
+        bool fUndo = txdb.ReadBlockUndo(pindex->GetBlockHash(), blockundo) && blockundo.vtxundo.size() + 1 == block.vtx.size();
+        for (int i = block.vtx.size()-1; i >= 0; i--)
+            if (!block.vtx[i].DisconnectInputs(txdb, view, (fUndo && i > 0) ? &blockundo.vtxundo[i-1] : NULL))
+                return error("ReplayCoins() : DisconnectInputs failed at %s", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+    }
+
+    // Replay the best chain from the fork.  Some of these changes may already
+    // be on disk, so only absolute operations are used: outputs are rewritten
+    // in full, and spending an output that is already gone is not an error.
+    vector<CBlockIndex*> vConnect;
+    for (CBlockIndex* pindex = pindexBest; pindex != pfork; pindex = pindex->pprev)
+        vConnect.push_back(pindex);
+    BOOST_REVERSE_FOREACH(CBlockIndex* pindex, vConnect)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("ReplayCoins() : ReadFromDisk for connect failed");
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            if (!tx.IsCoinBase())
+            {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                {
+                    CCoins coins;
+                    if (view.GetCoins(txin.prevout.hash, coins) && coins.Spend(txin.prevout.n))
+                        view.SetCoins(txin.prevout.hash, coins);
+                }
+            }
+            view.SetCoins(tx.GetHash(), CCoins(tx, pindex->nHeight));
+        }
+    }
+
+    printf("ReplayCoins() : disconnected %d and replayed %d blocks\n", pindexCoins->nHeight - pfork->nHeight, (int)vConnect.size());
+
+    view.Flush();
+    coinsTip.SetBestBlock(hashBestChain);
+    return FlushCoinsCache(true);
 }
 
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
@@ -936,18 +1435,19 @@ unsigned int ComputeMinWork(unsigned int nBase, int64 nTime)
     return bnResult.GetCompact();
 }
 
+// Guards CBlockIndex::nBitsNextKGW
+static CCriticalSection cs_nBitsNextKGW;
+
 unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBlock *pblock, uint64 TargetBlocksSpacingSeconds, uint64 PastBlocksMin, uint64 PastBlocksMax) {
     /* current difficulty formula, megacoin - kimoto gravity well */
     const CBlockIndex  *BlockLastSolved				= pindexLast;
     const CBlockIndex  *BlockReading				= pindexLast;
-    const CBlock       *BlockCreating				= pblock;
-                        BlockCreating				= BlockCreating;
     uint64				PastBlocksMass				= 0;
     int64				PastRateActualSeconds		= 0;
     int64				PastRateTargetSeconds		= 0;
     double				PastRateAdjustmentRatio		= double(1);
     CBigNum				PastDifficultyAverage;
-    CBigNum				PastDifficultyAveragePrev;
+    CBigNum				bnReading;
     double				EventHorizonDeviation;
     double				EventHorizonDeviationFast;
     double				EventHorizonDeviationSlow;
@@ -959,9 +1459,14 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBloc
         if (PastBlocksMax > 0 && i > PastBlocksMax) { break; }
         PastBlocksMass++;
 
+        // Running average, updated in place: avg += (nBits - avg) / i
         if (i == 1)	{ PastDifficultyAverage.SetCompact(BlockReading->nBits); }
-        else		{ PastDifficultyAverage = ((CBigNum().SetCompact(BlockReading->nBits) - PastDifficultyAveragePrev) / i) + PastDifficultyAveragePrev; }
-        PastDifficultyAveragePrev = PastDifficultyAverage;
+        else {
+            bnReading.SetCompact(BlockReading->nBits);
+            bnReading -= PastDifficultyAverage;
+            bnReading /= CBigNum(i);
+            PastDifficultyAverage += bnReading;
+        }
 
         if (LatestBlockTime < BlockReading->GetBlockTime()) {
             if (BlockReading->nHeight > FIX_KGW_TIMEWARP_HEIGHT)
@@ -978,11 +1483,12 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBloc
         if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
         PastRateAdjustmentRatio			= double(PastRateTargetSeconds) / double(PastRateActualSeconds);
         }
-        EventHorizonDeviation			= 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
-        EventHorizonDeviationFast		= EventHorizonDeviation;
-        EventHorizonDeviationSlow		= 1 / EventHorizonDeviation;
 
+        // The event horizon only matters once the minimum mass is reached
         if (PastBlocksMass >= PastBlocksMin) {
+            EventHorizonDeviation			= 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
+            EventHorizonDeviationFast		= EventHorizonDeviation;
+            EventHorizonDeviationSlow		= 1 / EventHorizonDeviation;
             if ((PastRateAdjustmentRatio <= EventHorizonDeviationSlow) || (PastRateAdjustmentRatio >= EventHorizonDeviationFast)) { assert(BlockReading); break; }
         }
         if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
@@ -997,10 +1503,13 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBloc
     if (bnNew > bnProofOfWorkLimit) { bnNew = bnProofOfWorkLimit; }
 
     /// debug print
-    printf("Difficulty Retarget - Kimoto Gravity Well\n");
-    printf("PastRateAdjustmentRatio = %g\n", PastRateAdjustmentRatio);
-    printf("Before: %08x  %s\n", BlockLastSolved->nBits, CBigNum().SetCompact(BlockLastSolved->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    if (fDebug)
+    {
+        printf("Difficulty Retarget - Kimoto Gravity Well\n");
+        printf("PastRateAdjustmentRatio = %g\n", PastRateAdjustmentRatio);
+        printf("Before: %08x  %s\n", BlockLastSolved->nBits, uint256().SetCompact(BlockLastSolved->nBits).ToString().c_str());
+        printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    }
 
     return bnNew.GetCompact();
 }
@@ -1097,7 +1606,7 @@ unsigned int static GetNextWorkRequired_V1(const CBlockIndex* pindexLast, const
     /// debug print
     printf("GetNextWorkRequired RETARGET\n");
     printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nCurrentTimespan, nActualTimespan);
-    printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
+    printf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
     printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
 
     return bnNew.GetCompact();
@@ -1112,10 +1621,26 @@ unsigned int static GetNextWorkRequired_V2(const CBlockIndex* pindexLast, const
     uint64				PastBlocksMin				= PastSecondsMin / BlocksTargetSpacing;
     uint64				PastBlocksMax				= PastSecondsMax / BlocksTargetSpacing;
 
-    return KimotoGravityWell(pindexLast, pblock, BlocksTargetSpacing, PastBlocksMin, PastBlocksMax);
+    // The result depends only on pindexLast and its ancestors, so each
+    // block's successor target is worked out once and kept in its index.
+    // Callers aren't all under cs_main, so the cache has its own lock; the
+    // walk itself only follows pprev links, which never change.
+    if (pindexLast)
+    {
+        LOCK(cs_nBitsNextKGW);
+        if (pindexLast->nBitsNextKGW != 0)
+            return pindexLast->nBitsNextKGW;
+    }
+    unsigned int nBits = KimotoGravityWell(pindexLast, pblock, BlocksTargetSpacing, PastBlocksMin, PastBlocksMax);
+    if (pindexLast)
+    {
+        LOCK(cs_nBitsNextKGW);
+        pindexLast->nBitsNextKGW = nBits;
+    }
+    return nBits;
 }
 
-unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlock *pblock)
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlock *pblock)
 {
     int DiffMode = 0;
     if (fTestNet) {
@@ -1134,112 +1659,433 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative, fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || fOverflow || bnTarget == 0 || bnTarget > hashProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
 }
 
-// Return maximum amount of blocks that other nodes claim to have
-int GetNumBlocksOfPeers()
-{
-    return std::max(cPeerBlockCounts.median(), Checkpoints::GetTotalBlocksEstimate());
-}
 
-bool IsInitialBlockDownload()
+//////////////////////////////////////////////////////////////////////////////
+//
+// Proof-of-work verification threads
+//
+
+/** Queue of block headers to scrypt, shared by the verification threads.
+ *  The thread that submits a batch works on it as well, and returns once
+ *  every header in the batch has been hashed.
+ */
+class CPoWCheckQueue
 {
-    if (pindexBest == NULL || nBestHeight < Checkpoints::GetTotalBlocksEstimate())
-        return true;
-    static int64 nLastUpdate;
-    static CBlockIndex* pindexLastBest;
-    if (pindexBest != pindexLastBest)
+private:
+    boost::mutex mutexMaster;   // one batch at a time
+    boost::mutex mutex;         // protects the fields below
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    const char* pheaders;
+    char* phashes;
+    unsigned int nTotal;
+    unsigned int nNext;
+    unsigned int nDone;
+    int nWorkers;
+    bool fQuit;
+
+    // Hash claimed runs of headers until the current batch is exhausted;
+    // worker threads then sleep until the next batch or shutdown.
+    void Loop(char* scratchpad, bool fWorker)
     {
-        pindexLastBest = pindexBest;
-        nLastUpdate = GetTime();
+        unsigned int nWays = scrypt_best_throughput();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        loop
+        {
+            while (fWorker && !fQuit && nNext >= nTotal)
+                condWorker.wait(lock);
+            // The submitting thread must finish its batch even on shutdown
+            if ((fWorker && fQuit) || nNext >= nTotal)
+                return;
+
+            // Hand out full SIMD batches while there is plenty of work, and
+            // single headers near the end so every thread stays busy.
+            unsigned int nLeft = nTotal - nNext;
+            unsigned int nCount = std::min(nWays, std::max(1U, nLeft / (nWorkers + 1)));
+            const char* pin = pheaders + 80 * nNext;
+            char* pout = phashes + 32 * nNext;
+            nNext += nCount;
+
+            lock.unlock();
+            scrypt_1024_1_1_256_sp_multi(pin, pout, scratchpad, nCount);
+            lock.lock();
+
+            nDone += nCount;
+            if (nDone == nTotal)
+                condMaster.notify_one();
+        }
     }
-    return (GetTime() - nLastUpdate < 10 &&
-            pindexBest->GetBlockTime() < GetTime() - 24 * 60 * 60);
-}
 
-void static InvalidChainFound(CBlockIndex* pindexNew)
-{
-    if (pindexNew->bnChainWork > bnBestInvalidWork)
+public:
+    CPoWCheckQueue() : pheaders(NULL), phashes(NULL), nTotal(0), nNext(0), nDone(0), nWorkers(0), fQuit(false) {}
+
+    void Hash(const char* pheadersIn, char* phashesIn, unsigned int nCount)
     {
-        bnBestInvalidWork = pindexNew->bnChainWork;
-        CTxDB().WriteBestInvalidWork(bnBestInvalidWork);
-        uiInterface.NotifyBlocksChanged();
+        boost::unique_lock<boost::mutex> lockMaster(mutexMaster);
+        std::vector<char> vScratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pheaders = pheadersIn;
+            phashes = phashesIn;
+            nTotal = nCount;
+            nNext = 0;
+            nDone = 0;
+        }
+        condWorker.notify_all();
+        Loop(&vScratchpad[0], false);
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (nDone < nTotal)
+            condMaster.wait(lock);
+        pheaders = NULL;
+        phashes = NULL;
+        nTotal = nNext = nDone = 0;
     }
-    printf("InvalidChainFound: invalid block=%s  height=%d  work=%s  date=%s\n",
-      pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight,
-      pindexNew->bnChainWork.ToString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
-      pindexNew->GetBlockTime()).c_str());
-    printf("InvalidChainFound:  current best=%s  height=%d  work=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str(),
-      DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
-    if (pindexBest && bnBestInvalidWork > bnBestChainWork + pindexBest->GetBlockWork() * 6)
-        printf("InvalidChainFound: WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.\n");
-}
-
-void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
-{
-    nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
 
-    // Updating time can change work required on testnet:
-    if (fTestNet)
-        nBits = GetNextWorkRequired(pindexPrev, this);
-}
+    void Work()
+    {
+        std::vector<char> vScratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nWorkers++;
+        }
+        Loop(&vScratchpad[0], true);
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWorkers--;
+    }
+
+    bool HasWorkers()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nWorkers > 0;
+    }
+
+    void Quit()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+    }
+};
+
+static CPoWCheckQueue powcheckqueue;
+
+// Block hash -> scrypt hash, filled by PrecomputePoWHashes() and consumed
+// by CBlock::GetPoWHash()
+static CCriticalSection cs_mapPoWHash;
+static map<uint256, uint256> mapPoWHash;
+static const unsigned int MAX_POWHASH_CACHE = 16384;
+
+bool GetPrecomputedPoWHash(const uint256& hashBlock, uint256& hashPoW)
+{
+    LOCK(cs_mapPoWHash);
+    map<uint256, uint256>::iterator mi = mapPoWHash.find(hashBlock);
+    if (mi == mapPoWHash.end())
+        return false;
+    hashPoW = (*mi).second;
+    mapPoWHash.erase(mi);
+    return true;
+}
+
+// Scrypt nCount consecutive 80-byte block headers on the verification
+// threads and remember the results for CheckBlock.
+static void PrecomputePoWHashes(const char* pheaders, unsigned int nCount)
+{
+    // Nothing to gain without extra threads or a SIMD kernel
+    if (!powcheckqueue.HasWorkers() && scrypt_best_throughput() == 1)
+        return;
+
+    vector<char> vHeaders;
+    vector<uint256> vHashBlock;
+    vHeaders.reserve(80 * nCount);
+    vHashBlock.reserve(nCount);
+    {
+        LOCK(cs_mapPoWHash);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            const char* p = pheaders + 80 * i;
+            uint256 hashBlock = Hash(p, p + 80);
+            if (mapPoWHash.count(hashBlock))
+                continue;
+            vHeaders.insert(vHeaders.end(), p, p + 80);
+            vHashBlock.push_back(hashBlock);
+        }
+    }
+    // A lone header is hashed just as fast inline by CheckBlock
+    if (vHashBlock.size() < 2)
+        return;
+
+    vector<char> vPoWHash(32 * vHashBlock.size());
+    powcheckqueue.Hash(&vHeaders[0], &vPoWHash[0], vHashBlock.size());
+
+    LOCK(cs_mapPoWHash);
+    for (unsigned int i = 0; i < vHashBlock.size(); i++)
+    {
+        if (mapPoWHash.size() >= MAX_POWHASH_CACHE)
+        {
+            // Evict a random entry, as the signature cache does
+            map<uint256, uint256>::iterator it = mapPoWHash.lower_bound(GetRandHash());
+            if (it == mapPoWHash.end())
+                it = mapPoWHash.begin();
+            mapPoWHash.erase(it);
+        }
+        uint256 hashPoW;
+        memcpy(BEGIN(hashPoW), &vPoWHash[32 * i], 32);
+        mapPoWHash[vHashBlock[i]] = hashPoW;
+    }
+}
+
+static void PrecomputePoWHashes(const vector<CBlock>& vBlocks)
+{
+    vector<char> vHeaders;
+    vHeaders.reserve(80 * vBlocks.size());
+    BOOST_FOREACH(const CBlock& block, vBlocks)
+        vHeaders.insert(vHeaders.end(), BEGIN(block.nVersion), END(block.nNonce));
+    if (!vBlocks.empty())
+        PrecomputePoWHashes(&vHeaders[0], vBlocks.size());
+}
+
+// Pick out the headers of the "block" messages waiting in a peer's queue,
+// so they can be hashed together before ProcessMessage gets to them one at
+// a time.  Messages left over from an earlier pass were already scanned.
+static void PrecomputeQueuedBlockPoW(list<CNetMessage>& vRecvMsg)
+{
+    vector<char> vHeaders;
+    BOOST_FOREACH(CNetMessage& msg, vRecvMsg)
+    {
+        if (msg.fPoWScanned)
+            continue;
+        msg.fPoWScanned = true;
+        if (msg.strCommand == "block" && msg.vRecv.size() >= 80)
+            vHeaders.insert(vHeaders.end(), msg.vRecv.begin(), msg.vRecv.begin() + 80);
+    }
+    if (vHeaders.size() >= 2 * 80)
+        PrecomputePoWHashes(&vHeaders[0], vHeaders.size() / 80);
+}
+
+void static ThreadPoWCheck(void* parg)
+{
+    // Make this thread recognisable as a verification thread
+    RenameThread("bitcoin-powcheck");
+
+    try
+    {
+        vnThreadsRunning[THREAD_POWCHECK]++;
+        powcheckqueue.Work();
+        vnThreadsRunning[THREAD_POWCHECK]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_POWCHECK]--;
+        PrintException(&e, "ThreadPoWCheck()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_POWCHECK]--;
+        PrintException(NULL, "ThreadPoWCheck()");
+    }
+}
+
+void StartPoWCheckThreads()
+{
+    // The submitting thread does its share, so start one fewer
+    for (int i = 0; i < nVerifyThreads - 1; i++)
+        if (!CreateThread(ThreadPoWCheck, NULL))
+            printf("Error: CreateThread(ThreadPoWCheck) failed\n");
+    if (nVerifyThreads > 1)
+        printf("Using %d threads for proof-of-work verification\n", nVerifyThreads);
+}
+
+void StopPoWCheckThreads()
+{
+    powcheckqueue.Quit();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Script verification threads
+//
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, fStrictPayToScriptHash, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
+    return true;
+}
+
+void static ThreadScriptCheck(void* parg)
+{
+    // Make this thread recognisable as a verification thread
+    RenameThread("bitcoin-scriptch");
+
+    try
+    {
+        vnThreadsRunning[THREAD_SCRIPTCHECK]++;
+        scriptcheckqueue.Thread();
+        vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+        PrintException(&e, "ThreadScriptCheck()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+        PrintException(NULL, "ThreadScriptCheck()");
+    }
+}
+
+void StartScriptCheckThreads()
+{
+    // ConnectBlock waits on the queue itself, so start one fewer
+    for (int i = 0; i < nVerifyThreads - 1; i++)
+        if (!CreateThread(ThreadScriptCheck, NULL))
+            printf("Error: CreateThread(ThreadScriptCheck) failed\n");
+    if (nVerifyThreads > 1)
+        printf("Using %d threads for script verification\n", nVerifyThreads);
+}
+
+void StopScriptCheckThreads()
+{
+    scriptcheckqueue.Quit();
+}
+
+// Return maximum amount of blocks that other nodes claim to have
+int GetNumBlocksOfPeers()
+{
+    return std::max(cPeerBlockCounts.median(), Checkpoints::GetTotalBlocksEstimate());
+}
+
+bool IsInitialBlockDownload()
+{
+    if (pindexBest == NULL || nBestHeight < Checkpoints::GetTotalBlocksEstimate())
+        return true;
+    static int64 nLastUpdate;
+    static CBlockIndex* pindexLastBest;
+    if (pindexBest != pindexLastBest)
+    {
+        pindexLastBest = pindexBest;
+        nLastUpdate = GetTime();
+    }
+    return (GetTime() - nLastUpdate < 10 &&
+            pindexBest->GetBlockTime() < GetTime() - 24 * 60 * 60);
+}
+
+void static InvalidChainFound(CBlockIndex* pindexNew)
+{
+    if (pindexNew->nChainWork > nBestInvalidWork)
+    {
+        nBestInvalidWork = pindexNew->nChainWork;
+        CTxDB().WriteBestInvalidWork(nBestInvalidWork);
+        uiInterface.NotifyBlocksChanged();
+    }
+    printf("InvalidChainFound: invalid block=%s  height=%d  log2_work=%.8g  date=%s\n",
+      pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight,
+      log(pindexNew->nChainWork.getdouble())/log(2.0), DateTimeStrFormat("%x %H:%M:%S",
+      pindexNew->GetBlockTime()).c_str());
+    printf("InvalidChainFound:  current best=%s  height=%d  log2_work=%.8g  date=%s\n",
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0),
+      DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
+        printf("InvalidChainFound: WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.\n");
+
+    // Stop downloading blocks built on it
+    PruneHeaders(pindexNew);
+}
+
+void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
+{
+    nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+
+    // Updating time can change work required on testnet:
+    if (fTestNet)
+        nBits = GetNextWorkRequired(pindexPrev, this);
+}
 
 
 
 
 
 
-bool CTransaction::DisconnectInputs(CTxDB& txdb)
+bool CTransaction::DisconnectInputs(CTxDB& txdb, CCoinsCache& view, const CTxUndo* ptxundo)
 {
-    // Relinquish previous transactions' spent pointers
+    // Remove this transaction's own outputs.  They must all be unspent again
+    // by now, as later transactions are disconnected first.
+    view.SetCoins(GetHash(), CCoins());
+
+    // Give the previous transactions' outputs back
     if (!IsCoinBase())
     {
-        BOOST_FOREACH(const CTxIn& txin, vin)
+        if (ptxundo && ptxundo->vprevout.size() != vin.size())
+            return error("DisconnectInputs() : undo data does not match the inputs");
+
+        for (int i = vin.size()-1; i >= 0; i--)
         {
-            COutPoint prevout = txin.prevout;
+            COutPoint prevout = vin[i].prevout;
+            const CTxInUndo* pundo = ptxundo ? &ptxundo->vprevout[i] : NULL;
 
-            // Get prev txindex from disk
-            CTxIndex txindex;
-            if (!txdb.ReadTxIndex(prevout.hash, txindex))
-                return error("DisconnectInputs() : ReadTxIndex failed");
+            CCoins coins;
+            if (!view.GetCoins(prevout.hash, coins) && pundo && pundo->nHeight > 0)
+            {
+                // This spend emptied the record; recreate it
+                coins.fCoinBase = pundo->fCoinBase;
+                coins.nHeight = pundo->nHeight;
+                coins.vout.resize(pundo->nOutputs);
+            }
 
-            if (prevout.n >= txindex.vSpent.size())
-                return error("DisconnectInputs() : prevout.n out of range");
+            if (pundo && !coins.vout.empty())
+            {
+                if (prevout.n >= coins.vout.size())
+                    return error("DisconnectInputs() : prevout.n out of range");
+                coins.vout[prevout.n] = pundo->txout;
+            }
+            else
+            {
+                // Block connected without undo data; get the output back from
+                // the previous transaction on disk
+                CTransaction txPrev;
+                CTxIndex txindex;
+                if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
+                    return error("DisconnectInputs() : ReadFromDisk prev tx %s failed", prevout.hash.ToString().substr(0,10).c_str());
+                if (coins.vout.empty())
+                {
+                    coins = CCoins(txPrev, txindex.GetHeightInMainChain());
+                    if (coins.nHeight < 0)
+                        return error("DisconnectInputs() : prev tx %s not in main chain", prevout.hash.ToString().substr(0,10).c_str());
+                    BOOST_FOREACH(CTxOut& txout, coins.vout)
+                        txout.SetNull();
+                }
+                if (prevout.n >= coins.vout.size())
+                    return error("DisconnectInputs() : prevout.n out of range");
+                coins.vout[prevout.n] = txPrev.vout[prevout.n];
+            }
 
             // Mark outpoint as not spent
-            txindex.vSpent[prevout.n].SetNull();
-
-            // Write back
-            if (!txdb.UpdateTxIndex(prevout.hash, txindex))
-                return error("DisconnectInputs() : UpdateTxIndex failed");
+            view.SetCoins(prevout.hash, coins);
         }
     }
 
-    // Remove transaction from index
-    // This can fail if a duplicate of this transaction was in a chain that got
-    // reorganized away. This is only possible if this transaction was completely
-    // spent, so erasing it would be a no-op anway.
-    txdb.EraseTxIndex(*this);
-
     return true;
 }
 
 
-bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-                               bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+bool CTransaction::FetchInputs(CCoinsCache& view, bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
 {
     // FetchInputs can return false either because we just haven't seen some inputs
     // (in which case the transaction should be stored as an orphan)
@@ -1256,41 +2102,20 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         if (inputsRet.count(prevout.hash))
             continue; // Got it already
 
-        // Read txindex
-        CTxIndex& txindex = inputsRet[prevout.hash].first;
-        bool fFound = true;
-        if ((fBlock || fMiner) && mapTestPool.count(prevout.hash))
-        {
-            // Get txindex from current proposed changes
-            txindex = mapTestPool.find(prevout.hash)->second;
-        }
-        else
+        // Read coins from the view, which includes current proposed changes
+        CCoins& coins = inputsRet[prevout.hash];
+        if (!view.GetCoins(prevout.hash, coins))
         {
-            // Read txindex from txdb
-            fFound = txdb.ReadTxIndex(prevout.hash, txindex);
-        }
-        if (!fFound && (fBlock || fMiner))
-            return fMiner ? false : error("FetchInputs() : %s prev tx %s index entry not found", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+            if (fBlock || fMiner)
+                return fMiner ? false : error("FetchInputs() : %s prev tx %s unspent outputs not found", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
 
-        // Read txPrev
-        CTransaction& txPrev = inputsRet[prevout.hash].second;
-        if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
-        {
             // Get prev tx from single transactions in memory
             {
                 LOCK(mempool.cs);
                 if (!mempool.exists(prevout.hash))
                     return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
-                txPrev = mempool.lookup(prevout.hash);
+                coins = CCoins(mempool.lookup(prevout.hash), MEMPOOL_HEIGHT);
             }
-            if (!fFound)
-                txindex.vSpent.resize(txPrev.vout.size());
-        }
-        else
-        {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
-                return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
         }
     }
 
@@ -1299,14 +2124,13 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
     {
         const COutPoint prevout = vin[i].prevout;
         assert(inputsRet.count(prevout.hash) != 0);
-        const CTxIndex& txindex = inputsRet[prevout.hash].first;
-        const CTransaction& txPrev = inputsRet[prevout.hash].second;
-        if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
+        const CCoins& coins = inputsRet[prevout.hash];
+        if (prevout.n >= coins.vout.size())
         {
             // Revisit this if/when transaction replacement is implemented and allows
             // adding inputs:
             fInvalid = true;
-            return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %d %d prev tx %s\n%s", GetHash().ToString().substr(0,10).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString().substr(0,10).c_str(), txPrev.ToString().c_str()));
+            return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %d prev tx %s", GetHash().ToString().substr(0,10).c_str(), prevout.n, coins.vout.size(), prevout.hash.ToString().substr(0,10).c_str()));
         }
     }
 
@@ -1319,11 +2143,11 @@ const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& in
     if (mi == inputs.end())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.hash not found");
 
-    const CTransaction& txPrev = (mi->second).second;
-    if (input.prevout.n >= txPrev.vout.size())
+    const CCoins& coins = mi->second;
+    if (input.prevout.n >= coins.vout.size())
         throw std::runtime_error("CTransaction::GetOutputFor() : prevout.n out of range");
 
-    return txPrev.vout[input.prevout.n];
+    return coins.vout[input.prevout.n];
 }
 
 int64 CTransaction::GetValueIn(const MapPrevTx& inputs) const
@@ -1355,11 +2179,11 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
     return nSigOps;
 }
 
-bool CTransaction::ConnectInputs(MapPrevTx inputs,
-                                 map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash)
+bool CTransaction::ConnectInputs(MapPrevTx inputs, CCoinsCache& view,
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash,
+                                 bool fVerifyScripts, std::vector<CScriptCheck> *pvChecks, CTxUndo* ptxundo)
 {
-    // Take over previous transactions' spent pointers
+    // Spend the previous transactions' outputs
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
     // fMiner is true when called from the internal sexcoin miner
     // ... both are false when called from CTransaction::AcceptToMemoryPool
@@ -1371,21 +2195,24 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
         {
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
-            CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            CCoins& coins = inputs[prevout.hash];
 
-            if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
-                return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %d %d prev tx %s\n%s", GetHash().ToString().substr(0,10).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString().substr(0,10).c_str(), txPrev.ToString().c_str()));
+            if (prevout.n >= coins.vout.size())
+                return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %d prev tx %s", GetHash().ToString().substr(0,10).c_str(), prevout.n, coins.vout.size(), prevout.hash.ToString().substr(0,10).c_str()));
+
+            // Check for conflicts (double-spend)
+            // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
+            // for an attacker to attempt to split the network.
+            if (!coins.IsAvailable(prevout.n))
+                return fMiner ? false : error("ConnectInputs() : %s prev tx %s output %d already spent", GetHash().ToString().substr(0,10).c_str(), prevout.hash.ToString().substr(0,10).c_str(), prevout.n);
 
             // If prev is coinbase, check that it's matured
-            if (txPrev.IsCoinBase())
-                for (const CBlockIndex* pindex = pindexBlock; pindex && pindexBlock->nHeight - pindex->nHeight < COINBASE_MATURITY; pindex = pindex->pprev)
-                    if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
-                        return error("ConnectInputs() : tried to spend coinbase at depth %d", pindexBlock->nHeight - pindex->nHeight);
+            if (coins.fCoinBase && pindexBlock->nHeight - coins.nHeight < COINBASE_MATURITY)
+                return error("ConnectInputs() : tried to spend coinbase at depth %d", pindexBlock->nHeight - coins.nHeight);
 
             // Check for negative or overflow input values
-            nValueIn += txPrev.vout[prevout.n].nValue;
-            if (!MoneyRange(txPrev.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coins.vout[prevout.n].nValue;
+            if (!MoneyRange(coins.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
                 return DoS(100, error("ConnectInputs() : txin values out of range"));
 
         }
@@ -1396,26 +2223,26 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
         {
             COutPoint prevout = vin[i].prevout;
             assert(inputs.count(prevout.hash) > 0);
-            CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            CCoins& coins = inputs[prevout.hash];
 
-            // Check for conflicts (double-spend)
-            // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
-            // for an attacker to attempt to split the network.
-            if (!txindex.vSpent[prevout.n].IsNull())
-                return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString().substr(0,10).c_str(), txindex.vSpent[prevout.n].ToString().c_str());
+            // An earlier input of this same transaction may have taken it
+            if (!coins.IsAvailable(prevout.n))
+                return fMiner ? false : error("ConnectInputs() : %s prev tx %s output %d already spent", GetHash().ToString().substr(0,10).c_str(), prevout.hash.ToString().substr(0,10).c_str(), prevout.n);
 
             // Skip ECDSA signature verification when connecting blocks (fBlock=true)
             // before the last blockchain checkpoint. This is safe because block merkle hashes are
             // still computed and checked, and any change will be caught at the next checkpoint.
-            if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
+            if (fVerifyScripts && !(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
+                // Leave the signature to the caller's check queue if it has one
+                if (pvChecks)
+                    pvChecks->push_back(CScriptCheck(coins, *this, i, fStrictPayToScriptHash, 0));
                 // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                else if (!VerifyScript(vin[i].scriptSig, coins.vout[prevout.n].scriptPubKey, *this, i, fStrictPayToScriptHash, 0))
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
-                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0))
+                    if (fStrictPayToScriptHash && VerifyScript(vin[i].scriptSig, coins.vout[prevout.n].scriptPubKey, *this, i, false, 0))
                         return error("ConnectInputs() : %s P2SH VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
@@ -1423,12 +2250,21 @@ bool CTransaction::ConnectInputs(MapPrevTx inputs,
             }
 
             // Mark outpoints as spent
-            txindex.vSpent[prevout.n] = posThisTx;
+            if (ptxundo)
+                ptxundo->vprevout.push_back(CTxInUndo(coins.vout[prevout.n]));
+            coins.Spend(prevout.n);
+            if (ptxundo && coins.IsPruned())
+            {
+                CTxInUndo& undo = ptxundo->vprevout.back();
+                undo.nHeight = coins.nHeight;
+                undo.fCoinBase = coins.fCoinBase;
+                undo.nOutputs = coins.vout.size();
+            }
 
             // Write back
             if (fBlock || fMiner)
             {
-                mapTestPool[prevout.hash] = txindex;
+                view.SetCoins(prevout.hash, coins);
             }
         }
 
@@ -1497,13 +2333,25 @@ bool CTransaction::ClientConnectInputs()
 
 
 
-bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
+bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex, CCoinsCache& view)
 {
+    // Blocks connected before undo data was kept have none
+    CBlockUndo blockundo;
+    bool fUndo = txdb.ReadBlockUndo(pindex->GetBlockHash(), blockundo) && blockundo.vtxundo.size() + 1 == vtx.size();
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
+    {
+        if (!vtx[i].DisconnectInputs(txdb, view, (fUndo && i > 0) ? &blockundo.vtxundo[i-1] : NULL))
             return false;
 
+        // Remove transaction from index
+        // This can fail if a duplicate of this transaction was in a chain that got
+        // reorganized away. This is only possible if this transaction was completely
+        // spent, so erasing it would be a no-op anway.
+        txdb.EraseTxIndex(vtx[i]);
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1517,12 +2365,17 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
-bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
+bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, CCoinsCache& view)
 {
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock())
+    if (!CheckBlock(pindex))
         return false;
 
+    // Fill in the scrypt hash for entries written before it was recorded;
+    // it reaches disk with the next write of this index entry
+    if (pindex->hashPoW == 0)
+        pindex->hashPoW = hashPoWChecked;
+
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
     // If such overwrites are allowed, coinbases and transactions depending upon those
@@ -1542,21 +2395,24 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     //// issue here: it doesn't know the version
     unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - 1 + GetSizeOfCompactSize(vtx.size());
 
-    map<uint256, CTxIndex> mapQueuedChanges;
+    // Signature checks for the whole block run on the verification threads
+    // while the rest of the block is connected; any failure fails the block
+    // before anything is written.
+    CCheckQueueControl<CScriptCheck> control(nVerifyThreads > 1 ? &scriptcheckqueue : NULL);
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.reserve(vtx.size() - 1);
+    vector<pair<uint256, CDiskTxPos> > vQueuedTxIndex;
+    vQueuedTxIndex.reserve(vtx.size());
     int64 nFees = 0;
     unsigned int nSigOps = 0;
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         uint256 hashTx = tx.GetHash();
 
-        if (fEnforceBIP30) {
-            CTxIndex txindexOld;
-            if (txdb.ReadTxIndex(hashTx, txindexOld)) {
-                BOOST_FOREACH(CDiskTxPos &pos, txindexOld.vSpent)
-                    if (pos.IsNull())
-                        return false;
-            }
-        }
+        // An older transaction with this hash must have nothing left to spend
+        if (fEnforceBIP30 && view.HaveCoins(hashTx))
+            return false;
 
         nSigOps += tx.GetLegacySigOpCount();
         if (nSigOps > MAX_BLOCK_SIGOPS)
@@ -1569,7 +2425,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
         if (!tx.IsCoinBase())
         {
             bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
+            if (!tx.FetchInputs(view, true, false, mapInputs, fInvalid))
                 return false;
 
             if (fStrictPayToScriptHash)
@@ -1584,17 +2440,27 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 
             nFees += tx.GetValueIn(mapInputs)-tx.GetValueOut();
 
-            if (!tx.ConnectInputs(mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash))
+            std::vector<CScriptCheck> vChecks;
+            blockundo.vtxundo.push_back(CTxUndo());
+            if (!tx.ConnectInputs(mapInputs, view, pindex, true, false, fStrictPayToScriptHash, true, nVerifyThreads > 1 ? &vChecks : NULL, &blockundo.vtxundo.back()))
                 return false;
+            control.Add(vChecks);
         }
 
-        mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+        view.SetCoins(hashTx, CCoins(tx, pindex->nHeight));
+        vQueuedTxIndex.push_back(make_pair(hashTx, posThisTx));
     }
 
-    // Write queued txindex changes
-    for (map<uint256, CTxIndex>::iterator mi = mapQueuedChanges.begin(); mi != mapQueuedChanges.end(); ++mi)
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : %s script verification failed", GetHash().ToString().substr(0,20).c_str()));
+
+    // Write queued txindex changes and the undo data; coin changes stay in
+    // the caller's view
+    if (!txdb.WriteBlockUndo(pindex->GetBlockHash(), blockundo))
+        return error("ConnectBlock() : WriteBlockUndo failed");
+    for (unsigned int i = 0; i < vQueuedTxIndex.size(); i++)
     {
-        if (!txdb.UpdateTxIndex((*mi).first, (*mi).second))
+        if (!txdb.UpdateTxIndex(vQueuedTxIndex[i].first, CTxIndex(vQueuedTxIndex[i].second)))
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
@@ -1618,6 +2484,105 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+// Height pskip jumps back to from nHeight: clearing low bits keeps the jumps
+// of neighbouring blocks far apart, so GetAncestor takes O(log n) steps
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn)
+{
+    if (nHeightIn > nHeight || nHeightIn < 0)
+        return NULL;
+
+    // On the best chain, just look it up
+    if (nHeightIn < (int)vMainChain.size() && nHeight < (int)vMainChain.size() && vMainChain[nHeight] == this)
+        return vMainChain[nHeightIn];
+
+    CBlockIndex* pindex = this;
+    while (pindex->nHeight > nHeightIn)
+    {
+        int nHeightSkip = GetSkipHeight(pindex->nHeight);
+        int nHeightSkipPrev = GetSkipHeight(pindex->nHeight - 1);
+        // Take the skip unless it overshoots, or pprev's skip gets closer
+        if (pindex->pskip && (nHeightSkip == nHeightIn ||
+             (nHeightSkip > nHeightIn && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nHeightIn))))
+            pindex = pindex->pskip;
+        else
+            pindex = pindex->pprev;
+    }
+    return pindex;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightIn);
+}
+
+// Block index entries live as long as the process, bar the headers
+// PruneHeaders drops, so they're cut from large chunks rather than each being
+// a heap allocation of its own.  Dropped entries are reused.
+static const unsigned int BLOCK_INDEX_CHUNK = 4096;
+static CBlockIndex* pBlockIndexChunk = NULL;
+static unsigned int nBlockIndexChunkUsed = BLOCK_INDEX_CHUNK;
+static vector<CBlockIndex*> vBlockIndexFree;
+
+CBlockIndex* NewBlockIndex()
+{
+    void* p;
+    if (!vBlockIndexFree.empty())
+    {
+        p = vBlockIndexFree.back();
+        vBlockIndexFree.pop_back();
+    }
+    else
+    {
+        if (nBlockIndexChunkUsed == BLOCK_INDEX_CHUNK)
+        {
+            pBlockIndexChunk = (CBlockIndex*)::operator new(sizeof(CBlockIndex) * BLOCK_INDEX_CHUNK);
+            nBlockIndexChunkUsed = 0;
+        }
+        p = pBlockIndexChunk + nBlockIndexChunkUsed++;
+    }
+    return new (p) CBlockIndex();
+}
+
+void FreeBlockIndex(CBlockIndex* pindex)
+{
+    pindex->~CBlockIndex();
+    vBlockIndexFree.push_back(pindex);
+}
+
+// Make vMainChain end in pindexNew, rewinding to where it forks off
+void SetMainChainIndex(CBlockIndex* pindexNew)
+{
+    CBlockIndex* pfork = pindexNew;
+    while (pfork && !(pfork->nHeight < (int)vMainChain.size() && vMainChain[pfork->nHeight] == pfork))
+        pfork = pfork->pprev;
+    vMainChain.resize(pindexNew->nHeight + 1);
+    for (CBlockIndex* pindex = pindexNew; pindex != pfork; pindex = pindex->pprev)
+        vMainChain[pindex->nHeight] = pindex;
+}
+
+// The best chain's block at nHeight, NULL if out of range
+CBlockIndex* FindBlockByHeight(int nHeight)
+{
+    if (nHeight < 0 || nHeight >= (int)vMainChain.size())
+        return NULL;
+    return vMainChain[nHeight];
+}
+
 bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 {
     printf("REORGANIZE\n");
@@ -1650,6 +2615,10 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     printf("REORGANIZE: Disconnect %i blocks; %s..%s\n", vDisconnect.size(), pfork->GetBlockHash().ToString().substr(0,20).c_str(), pindexBest->GetBlockHash().ToString().substr(0,20).c_str());
     printf("REORGANIZE: Connect %i blocks; %s..%s\n", vConnect.size(), pfork->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->GetBlockHash().ToString().substr(0,20).c_str());
 
+    // Coin changes of the whole reorganization, moved into the tip cache
+    // only once the transaction has committed
+    CCoinsCache view(txdb);
+
     // Disconnect shorter branch
     vector<CTransaction> vResurrect;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
@@ -1657,7 +2626,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("Reorganize() : ReadFromDisk for disconnect failed");
-        if (!block.DisconnectBlock(txdb, pindex))
+        if (!block.DisconnectBlock(txdb, pindex, view))
             return error("Reorganize() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
 
         // Queue memory transactions to resurrect
@@ -1667,22 +2636,21 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     }
 
     // Connect longer branch
-    vector<CTransaction> vDelete;
+    vector<pair<vector<CTransaction>, int> > vDelete;
     for (unsigned int i = 0; i < vConnect.size(); i++)
     {
         CBlockIndex* pindex = vConnect[i];
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("Reorganize() : ReadFromDisk for connect failed");
-        if (!block.ConnectBlock(txdb, pindex))
+        if (!block.ConnectBlock(txdb, pindex, view))
         {
             // Invalid block
             return error("Reorganize() : ConnectBlock %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
         }
 
         // Queue memory transactions to delete
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            vDelete.push_back(tx);
+        vDelete.push_back(make_pair(block.vtx, pindex->nHeight));
     }
     if (!txdb.WriteHashBestChain(pindexNew->GetBlockHash()))
         return error("Reorganize() : WriteHashBestChain failed");
@@ -1690,6 +2658,8 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     // Make sure it's successfully written to disk before changing memory structure
     if (!txdb.TxnCommit())
         return error("Reorganize() : TxnCommit failed");
+    view.Flush();
+    coinsTip.SetBestBlock(pindexNew->GetBlockHash());
 
     // Disconnect shorter branch
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
@@ -1700,14 +2670,15 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    SetMainChainIndex(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
         tx.AcceptToMemoryPool(txdb, false);
 
     // Delete redundant memory transactions that are in the connected branch
-    BOOST_FOREACH(CTransaction& tx, vDelete)
-        mempool.remove(tx);
+    for (unsigned int i = 0; i < vDelete.size(); i++)
+        mempool.removeForBlock(vDelete[i].first, vDelete[i].second);
 
     printf("REORGANIZE: done\n");
 
@@ -1715,13 +2686,41 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 }
 
 
+// Tell each -blocknotifyudp address about a new best block with a datagram
+// holding its hash, so miners don't have to poll for it.  Runs on its own
+// thread, away from cs_main.
+static void SendBlockNotifyUDP(uint256 hash)
+{
+    string strMessage = hash.GetHex() + "\n";
+    BOOST_FOREACH(const string& strDest, mapMultiArgs["-blocknotifyudp"])
+    {
+        CService addr;
+        if (!Lookup(strDest.c_str(), addr, 0, false) || addr.GetPort() == 0)
+        {
+            printf("SendBlockNotifyUDP() : bad address %s\n", strDest.c_str());
+            continue;
+        }
+        struct sockaddr_storage sockaddr;
+        socklen_t len = sizeof(sockaddr);
+        if (!addr.GetSockAddr((struct sockaddr*)&sockaddr, &len))
+            continue;
+        SOCKET hSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (hSocket == INVALID_SOCKET)
+            continue;
+        if (sendto(hSocket, strMessage.data(), strMessage.size(), 0, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR)
+            printf("SendBlockNotifyUDP() : sendto %s failed %d\n", strDest.c_str(), WSAGetLastError());
+        closesocket(hSocket);
+    }
+}
+
 // Called from inside SetBestChain: attaches a block to the new best chain being built
 bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 {
     uint256 hash = GetHash();
 
     // Adding to current best branch
-    if (!ConnectBlock(txdb, pindexNew) || !txdb.WriteHashBestChain(hash))
+    CCoinsCache view(txdb);
+    if (!ConnectBlock(txdb, pindexNew, view) || !txdb.WriteHashBestChain(hash))
     {
         txdb.TxnAbort();
         InvalidChainFound(pindexNew);
@@ -1729,13 +2728,15 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
     }
     if (!txdb.TxnCommit())
         return error("SetBestChain() : TxnCommit failed");
+    view.Flush();
+    coinsTip.SetBestBlock(hash);
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    SetMainChainIndex(pindexNew);
 
     // Delete redundant memory transactions
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        mempool.remove(tx);
+    mempool.removeForBlock(vtx, pindexNew->nHeight);
 
     return true;
 }
@@ -1749,10 +2750,15 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
     if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
     {
+        // The coin set is empty and consistent with genesis; say so in the
+        // same transaction so a crash before the first flush can be replayed
         txdb.WriteHashBestChain(hash);
+        txdb.WriteBestCoins(hash);
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
+        coinsTip.SetBestBlock(hash);
         pindexGenesisBlock = pindexNew;
+        SetMainChainIndex(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -1769,7 +2775,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
         // Reorganize is costly in terms of db load, as it works in a single db transaction.
         // Try to limit how much needs to be done inside
-        while (pindexIntermediate->pprev && pindexIntermediate->pprev->bnChainWork > pindexBest->bnChainWork)
+        while (pindexIntermediate->pprev && pindexIntermediate->pprev->nChainWork > pindexBest->nChainWork)
         {
             vpindexSecondary.push_back(pindexIntermediate);
             pindexIntermediate = pindexIntermediate->pprev;
@@ -1817,13 +2823,17 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     hashBestChain = hash;
     pindexBest = pindexNew;
     nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexNew->bnChainWork;
+    nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
-    printf("SetBestChain: new best=%s  height=%d  work=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str(),
+    printf("SetBestChain: new best=%s  height=%d  log2_work=%.8g  date=%s\n",
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
+    // Write buffered coin changes out if the cache is over budget or stale
+    if (!FlushCoinsCache())
+        printf("SetBestChain() : FlushCoinsCache failed\n");
+
     // Check the version of the last 100 blocks to see if we need to upgrade:
     if (!fIsInitialDownload)
     {
@@ -1850,6 +2860,10 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         boost::thread t(runCommand, strCmd); // thread runs free
     }
 
+    if (!fIsInitialDownload && mapArgs.count("-blocknotifyudp"))
+        boost::thread t(SendBlockNotifyUDP, hashBestChain); // thread runs free
+    NotifyNewWork();
+
     return true;
 }
 
@@ -1861,29 +2875,46 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     if (mapBlockIndex.count(hash))
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
-    // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    // Construct new block index object, or take over the header's, which
+    // later headers point to
+    CBlockIndex* pindexNew = NULL;
+    CBlockIndexMap::iterator miHeader = mapHeaderIndex.find(hash);
+    if (miHeader != mapHeaderIndex.end())
+    {
+        pindexNew = (*miHeader).second;
+        pindexNew->nFile = nFile;
+        pindexNew->nBlockPos = nBlockPos;
+        mapHeaderIndex.erase(miHeader);
+    }
+    else
+    {
+        pindexNew = NewBlockIndex();
+        *pindexNew = CBlockIndex(nFile, nBlockPos, *this);
+    }
+    if (pindexNew->hashPoW == 0)
+        pindexNew->hashPoW = GetPoWHash();
+    CBlockIndexMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
-    pindexNew->bnChainWork = (pindexNew->pprev ? pindexNew->pprev->bnChainWork : 0) + pindexNew->GetBlockWork();
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork();
+    SetBestHeader(pindexNew);
 
     CTxDB txdb;
     if (!txdb.TxnBegin())
         return false;
     txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
+    txdb.WriteBlockIndexCount(mapBlockIndex.size());
     if (!txdb.TxnCommit())
         return false;
 
     // New best
-    if (pindexNew->bnChainWork > bnBestChainWork)
+    if (pindexNew->nChainWork > nBestChainWork)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
@@ -1904,7 +2935,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 
 
 
-bool CBlock::CheckBlock() const
+bool CBlock::CheckBlock(const CBlockIndex* pindex) const
 {
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
@@ -1913,9 +2944,12 @@ bool CBlock::CheckBlock() const
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return DoS(100, error("CheckBlock() : size limits failed"));
 
-    // Check proof of work matches claimed amount
-    if (!CheckProofOfWork(GetPoWHash(), nBits))
+    // Check proof of work matches claimed amount.  When re-checking a block
+    // that is already indexed, reuse the scrypt hash recorded there.
+    uint256 hashPoW = (pindex && pindex->hashPoW != 0) ? pindex->hashPoW : GetPoWHash();
+    if (!CheckProofOfWork(hashPoW, nBits))
         return DoS(50, error("CheckBlock() : proof of work failed"));
+    hashPoWChecked = hashPoW;
 
     // Check timestamp
     if (GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
@@ -1966,7 +3000,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2026,7 +3060,7 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
     if (pcheckpoint && pblock->hashPrevBlock != hashBestChain)
     {
         // Extra checks to prevent "fill up memory by spamming with bogus blocks"
@@ -2058,15 +3092,20 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocks.insert(make_pair(hash, pblock2));
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+        // Ask this guy to fill in what we're missing, unless the block was
+        // fetched from the header chain, which we have already
+        if (pfrom && !mapHeaderIndex.count(hash))
+            pfrom->PushGetHeaders(pindexBestHeader, GetOrphanRoot(pblock2));
         return true;
     }
 
     // Store to disk
     if (!pblock->AcceptBlock())
+    {
+        if (pblock->nDoS && mapHeaderIndex.count(hash))
+            PruneHeaders(mapHeaderIndex[hash]);
         return error("ProcessBlock() : AcceptBlock FAILED");
+    }
 
     // Recursively process any orphan blocks that depended on this one
     vector<uint256> vWorkQueue;
@@ -2074,13 +3113,15 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-             mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-             ++mi)
+        typedef boost::unordered_multimap<uint256, CBlock*, CSaltedHasher>::iterator orphan_iterator;
+        std::pair<orphan_iterator, orphan_iterator> range = mapOrphanBlocksByPrev.equal_range(hashPrev);
+        for (orphan_iterator mi = range.first; mi != range.second; ++mi)
         {
             CBlock* pblockOrphan = (*mi).second;
             if (pblockOrphan->AcceptBlock())
                 vWorkQueue.push_back(pblockOrphan->GetHash());
+            else if (pblockOrphan->nDoS && mapHeaderIndex.count(pblockOrphan->GetHash()))
+                PruneHeaders(mapHeaderIndex[pblockOrphan->GetHash()]);
             mapOrphanBlocks.erase(pblockOrphan->GetHash());
             delete pblockOrphan;
         }
@@ -2093,6 +3134,237 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first sync
+//
+// Peers are asked for headers ("getheaders") first.  Headers are checked for
+// proof of work, retargeting and checkpoints and kept in mapHeaderIndex, and
+// the blocks of the best header chain are then requested from all peers at
+// once, a window ahead of the best chain, a few per peer at a time.
+//
+
+// Make pindexNew the tip of the best header chain if it has more work
+static void SetBestHeader(CBlockIndex* pindexNew)
+{
+    if (pindexBestHeader && pindexNew->nChainWork <= pindexBestHeader->nChainWork)
+        return;
+    pindexBestHeader = pindexNew;
+    nTimeBestHeader = GetTime();
+
+    // Rewind vHeaderChain to the fork and fill in the new branch
+    CBlockIndex* pfork = pindexNew;
+    while (pfork && !(pfork->nHeight < (int)vHeaderChain.size() && vHeaderChain[pfork->nHeight] == pfork))
+        pfork = pfork->pprev;
+    vHeaderChain.resize(pindexNew->nHeight + 1);
+    for (CBlockIndex* pindex = pindexNew; pindex != pfork; pindex = pindex->pprev)
+        vHeaderChain[pindex->nHeight] = pindex;
+}
+
+// Height where the best chain leaves the best header chain, or -1
+static int HeaderChainForkHeight()
+{
+    CBlockIndex* pfork = pindexBest;
+    while (pfork && !(pfork->nHeight < (int)vHeaderChain.size() && vHeaderChain[pfork->nHeight] == pfork))
+        pfork = pfork->pprev;
+    return pfork ? pfork->nHeight : -1;
+}
+
+// Headers in mapHeaderIndex that are not waiting on the best header chain.
+// The best header chain is bounded by the work it must carry; these are not,
+// so they are bounded by count.
+static unsigned int CountSideHeaders()
+{
+    unsigned int nOnBest = vHeaderChain.size() - (HeaderChainForkHeight() + 1);
+    return mapHeaderIndex.size() > nOnBest ? mapHeaderIndex.size() - nOnBest : 0;
+}
+
+// Forget the headers built on pindexBad, whose block turned out invalid, and
+// choose the best header chain again
+static void PruneHeaders(CBlockIndex* pindexBad)
+{
+    // Sort entries into descendants of pindexBad or not, remembering the
+    // answer for every entry walked through
+    set<CBlockIndex*> setBad, setGood;
+    setBad.insert(pindexBad);
+    vector<CBlockIndex*> vPath;
+    BOOST_FOREACH(PAIRTYPE(const uint256, CBlockIndex*)& item, mapHeaderIndex)
+    {
+        bool fBad = false;
+        vPath.clear();
+        for (CBlockIndex* pindex = item.second; pindex && pindex->nHeight >= pindexBad->nHeight; pindex = pindex->pprev)
+        {
+            if (setBad.count(pindex) || setGood.count(pindex))
+            {
+                fBad = setBad.count(pindex);
+                break;
+            }
+            vPath.push_back(pindex);
+        }
+        BOOST_FOREACH(CBlockIndex* pindex, vPath)
+            (fBad ? setBad : setGood).insert(pindex);
+    }
+
+    uint256 hashBad = pindexBad->GetBlockHash();
+    unsigned int nPruned = 0;
+    for (CBlockIndexMap::iterator mi = mapHeaderIndex.begin(); mi != mapHeaderIndex.end(); )
+    {
+        if (setBad.count((*mi).second))
+        {
+            FreeBlockIndex((*mi).second);
+            mapHeaderIndex.erase(mi++);
+            nPruned++;
+        }
+        else
+            ++mi;
+    }
+
+    pindexBestHeader = NULL;
+    vHeaderChain.clear();
+    CBlockIndex* pindexNewBest = pindexBest;
+    BOOST_FOREACH(PAIRTYPE(const uint256, CBlockIndex*)& item, mapHeaderIndex)
+        if (!pindexNewBest || item.second->nChainWork > pindexNewBest->nChainWork)
+            pindexNewBest = item.second;
+    if (pindexNewBest)
+        SetBestHeader(pindexNewBest);
+    printf("PruneHeaders() : dropped %u headers after invalid block %s\n", nPruned, hashBad.ToString().substr(0,20).c_str());
+}
+
+// Check a header received in a "headers" message and add it to
+// mapHeaderIndex.  Returns the index entry, old or new, in pindexRet.
+static bool AcceptHeader(const CBlock& header, CBlockIndex*& pindexRet)
+{
+    uint256 hash = header.GetHash();
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end() || (mi = mapHeaderIndex.find(hash)) != mapHeaderIndex.end())
+    {
+        pindexRet = (*mi).second;
+        return true;
+    }
+
+    // Get prev block index
+    CBlockIndex* pindexPrev = NULL;
+    if ((mi = mapBlockIndex.find(header.hashPrevBlock)) != mapBlockIndex.end() ||
+        (mi = mapHeaderIndex.find(header.hashPrevBlock)) != mapHeaderIndex.end())
+        pindexPrev = (*mi).second;
+    if (!pindexPrev)
+        return header.DoS(20, error("AcceptHeader() : prev block %s not found", header.hashPrevBlock.ToString().substr(0,20).c_str()));
+    int nHeight = pindexPrev->nHeight + 1;
+
+    // Headers that would not become the best header chain are only kept
+    // while there is room for them
+    CBlock headerCopy(header);
+    CBlockIndex indexNew(0, 0, headerCopy);
+    indexNew.nChainWork = pindexPrev->nChainWork + indexNew.GetBlockWork();
+    if (pindexBestHeader && indexNew.nChainWork <= pindexBestHeader->nChainWork &&
+        CountSideHeaders() >= MAX_SIDE_HEADERS)
+        return error("AcceptHeader() : too many headers off the best header chain, %s ignored", hash.ToString().substr(0,20).c_str());
+
+    // Check proof of work
+    uint256 hashPoW = header.GetPoWHash();
+    if (!CheckProofOfWork(hashPoW, header.nBits))
+        return header.DoS(50, error("AcceptHeader() : proof of work failed"));
+
+    // Check timestamp
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return error("AcceptHeader() : block timestamp too far in the future");
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return header.DoS(100, error("AcceptHeader() : block's timestamp is too early"));
+
+    // Check the Kimoto Gravity Well retarget.  Earlier retargets depend on
+    // nBestHeight rather than the header's own height, so those are left to
+    // AcceptBlock.
+    if (nHeight >= FIX_SECOND_RETARGET_HEIGHT && header.nBits != GetNextWorkRequired(pindexPrev, &header))
+        return header.DoS(100, error("AcceptHeader() : incorrect proof of work"));
+
+    // Check against checkpoints, and don't let forks below the last one in
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return header.DoS(100, error("AcceptHeader() : rejected by checkpoint lockin at %d", nHeight));
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+    if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+        return header.DoS(100, error("AcceptHeader() : forks below the last checkpoint at %d", nHeight));
+
+    CBlockIndex* pindexNew = NewBlockIndex();
+    *pindexNew = indexNew;
+    pindexNew->hashPoW = hashPoW;
+    mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    pindexNew->BuildSkip();
+    SetBestHeader(pindexNew);
+
+    pindexRet = pindexNew;
+    return true;
+}
+
+// Hand this peer blocks of the best header chain to download, and take
+// back requests it has not answered in time
+static void RequestBlocks(CNode* pto, vector<CInv>& vGetData)
+{
+    int64 nNow = GetTime();
+
+    // Drop requests that were answered or handed to another peer, and time
+    // out the rest
+    bool fStalled = false;
+    for (map<uint256, int64>::iterator mi = pto->mapBlocksInFlight.begin(); mi != pto->mapBlocksInFlight.end(); )
+    {
+        map<uint256, pair<CNode*, int64> >::iterator miGlobal = mapBlocksInFlight.find((*mi).first);
+        if (miGlobal == mapBlocksInFlight.end() || (*miGlobal).second.first != pto)
+            pto->mapBlocksInFlight.erase(mi++);
+        else if ((*mi).second + BLOCK_DOWNLOAD_TIMEOUT < nNow)
+        {
+            printf("block %s from %s timed out\n", (*mi).first.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+            mapBlocksInFlight.erase(miGlobal);
+            pto->mapBlocksInFlight.erase(mi++);
+            fStalled = true;
+        }
+        else
+            ++mi;
+    }
+    unsigned int nNodes;
+    {
+        LOCK(cs_vNodes);
+        nNodes = vNodes.size();
+    }
+    if (fStalled && nNodes > 1)
+    {
+        // Its blocks go to the other peers
+        pto->fDisconnect = true;
+        return;
+    }
+
+    // Requests of peers that disconnected before timing out
+    for (map<uint256, pair<CNode*, int64> >::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end(); )
+    {
+        if ((*mi).second.second + 2 * BLOCK_DOWNLOAD_TIMEOUT < nNow)
+            mapBlocksInFlight.erase(mi++);
+        else
+            ++mi;
+    }
+
+    if (pto->fClient || !pindexBestHeader || !pindexBest || pindexBestHeader->nChainWork <= pindexBest->nChainWork)
+        return;
+    unsigned int nMaxInFlight = pto->fInbound ? MAX_BLOCKS_IN_TRANSIT_PER_PEER / 4 : MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    if (pto->mapBlocksInFlight.size() >= nMaxInFlight)
+        return;
+
+    // Start where the best chain leaves the best header chain
+    int nStart = HeaderChainForkHeight() + 1;
+    int nEnd = min((int)vHeaderChain.size(), min(nStart + BLOCK_DOWNLOAD_WINDOW, pto->nSyncHeight + 1));
+    for (int nHeight = nStart; nHeight < nEnd && pto->mapBlocksInFlight.size() < nMaxInFlight; nHeight++)
+    {
+        uint256 hash = vHeaderChain[nHeight]->GetBlockHash();
+        if (mapBlocksInFlight.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        mapBlocksInFlight[hash] = make_pair(pto, nNow);
+        pto->mapBlocksInFlight[hash] = nNow;
+    }
+}
+
+
+
 
 
 
@@ -2180,6 +3452,7 @@ bool LoadBlockIndex(bool fAllowNew)
     if (!txdb.LoadBlockIndex())
         return false;
     txdb.Close();
+    NotifyNewWork();
 
     //
     // Init with genesis block
@@ -2226,7 +3499,7 @@ bool LoadBlockIndex(bool fAllowNew)
             printf("Searching for genesis block...\n");
             // This will figure out a valid hash and Nonce if you're
             // creating a different genesis block:
-            uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+            uint256 hashTarget = uint256().SetCompact(block.nBits);
             uint256 thash;
             char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
 
@@ -2263,6 +3536,10 @@ bool LoadBlockIndex(bool fAllowNew)
             return error("LoadBlockIndex() : genesis block not accepted");
     }
 
+    // Header sync starts from the best chain
+    if (pindexBest)
+        SetBestHeader(pindexBest);
+
     return true;
 }
 
@@ -2272,7 +3549,7 @@ void PrintBlockTree()
 {
     // precompute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2342,50 +3619,82 @@ void PrintBlockTree()
 
 bool LoadExternalBlockFile(FILE* fileIn)
 {
+    // Blocks are read ahead in batches so their proof-of-work can be hashed
+    // on the verification threads, then handed to ProcessBlock in file order.
+    const unsigned int nBatchSize = 64;
+
     int nLoaded = 0;
     {
         LOCK(cs_main);
         try {
             CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
             unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good() && !fRequestShutdown)
+            bool fEnd = false;
+            while (nPos != (unsigned int)-1 && !fEnd && blkdat.good() && !fRequestShutdown)
             {
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
+                vector<CBlock> vBlocks;
+                vector<unsigned int> vBlockPos; // position of each block's size field
+                while (vBlocks.size() < nBatchSize && nPos != (unsigned int)-1 && blkdat.good() && !fRequestShutdown)
+                {
+                    unsigned char pchData[65536];
+                    do {
+                        fseek(blkdat, nPos, SEEK_SET);
+                        int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
+                        if (nRead <= 8)
                         {
-                            nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
+                            nPos = (unsigned int)-1;
                             break;
                         }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
+                        void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
+                        if (nFind)
+                        {
+                            if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
+                            {
+                                nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
+                                break;
+                            }
+                            nPos += ((unsigned char*)nFind - pchData) + 1;
+                        }
+                        else
+                            nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
+                    } while(!fRequestShutdown);
+                    if (nPos == (unsigned int)-1)
+                        break;
+                    fseek(blkdat, nPos, SEEK_SET);
+                    unsigned int nSize;
+                    try {
+                        blkdat >> nSize;
+                        if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                        {
+                            CBlock block;
+                            blkdat >> block;
+                            vBlocks.push_back(block);
+                            vBlockPos.push_back(nPos);
+                            nPos += 4 + nSize;
+                        }
                     }
-                    else
-                        nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
-                } while(!fRequestShutdown);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                    catch (std::exception &e) {
+                        // Still process what was read before the error
+                        printf("%s() : Deserialize or I/O error caught during load\n",
+                               __PRETTY_FUNCTION__);
+                        fEnd = true;
+                        break;
+                    }
+                }
+
+                PrecomputePoWHashes(vBlocks);
+
+                for (unsigned int i = 0; i < vBlocks.size(); i++)
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    if (ProcessBlock(NULL,&block))
+                    if (!ProcessBlock(NULL, &vBlocks[i]))
                     {
-                        nLoaded++;
-                        nPos += 4 + nSize;
+                        // Resume scanning just past this block's message start,
+                        // re-reading whatever followed it
+                        nPos = vBlockPos[i];
+                        fEnd = false;
+                        break;
                     }
+                    nLoaded++;
                 }
             }
         }
@@ -2430,7 +3739,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && bnBestInvalidWork > bnBestChainWork + pindexBest->GetBlockWork() * 6)
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = "WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.";
@@ -2552,7 +3861,8 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               mapBlocksInFlight.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -2568,6 +3878,102 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
 unsigned char pchMessageStart[4]= { 0xfb, 0xc0, 0xb6, 0xdb }; // sexcoin:
 unsigned char pchMessageStart2[4]= { 0xfa, 0xce, 0x69, 0x69 }; // sexcoin: blockchain fix =JSC
 
+// Messages that only touch the peer, the address manager and the relay
+// memory are processed without cs_main, so they don't wait behind block
+// processing or another peer's getblocks.  "getdata" takes cs_main itself
+// just for the index lookups.
+static bool MessageNeedsChainLock(const string& strCommand)
+{
+    return !(strCommand == "ping" || strCommand == "verack" || strCommand == "addr" ||
+             strCommand == "getaddr" || strCommand == "getdata");
+}
+
+// Recently requested blocks as ready-to-send "block" messages, most recent
+// first, bounded by -maxblockcache.  When a new block arrives every peer we
+// announce it to asks for it, and they all get the same buffer.
+static CCriticalSection cs_mapBlockMessages;
+static list<pair<uint256, CSendBuffer> > lruBlockMessages;
+static map<uint256, list<pair<uint256, CSendBuffer> >::iterator> mapBlockMessages;
+static size_t nBlockMessagesSize = 0;
+static bool fBlockMessagesNewMagic = false;
+
+// Read the block stored at pindex straight into a "block" message, skipping
+// the deserialize and reserialize
+static bool ReadBlockMessageFromDisk(CBlockIndex* pindex, CSendBuffer& msgRet)
+{
+    // The block is preceded on disk by its message start and size
+    if (pindex->nBlockPos < sizeof(unsigned int))
+        return error("ReadBlockMessageFromDisk() : bad block position");
+    CAutoFile filein = CAutoFile(OpenBlockFile(pindex->nFile, pindex->nBlockPos - sizeof(unsigned int), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadBlockMessageFromDisk() : OpenBlockFile failed");
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("block", 0, true, nBestHeight);
+    unsigned int nMessageStart = ss.size();
+    try {
+        unsigned int nSize = 0;
+        filein >> nSize;
+        if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+            return error("ReadBlockMessageFromDisk() : bad block size %u", nSize);
+        ss.resize(nMessageStart + nSize);
+        filein.read(&ss[nMessageStart], nSize);
+    }
+    catch (std::exception &e) {
+        return error("ReadBlockMessageFromDisk() : I/O error");
+    }
+
+    // Make sure the index pointed at the block we think it did
+    if (Hash(&ss[nMessageStart], &ss[nMessageStart] + 80) != pindex->GetBlockHash())
+        return error("ReadBlockMessageFromDisk() : block on disk doesn't match index");
+
+    msgRet = FinishSharedMessage(ss, nMessageStart);
+    return true;
+}
+
+static CSendBuffer GetBlockMessage(CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    // The header's message start depends on our height at the time
+    bool fNewMagic = !(nBestHeight < MAGIC_NUM_SWITCH_HEIGHT);
+    {
+        LOCK(cs_mapBlockMessages);
+        if (fBlockMessagesNewMagic != fNewMagic)
+        {
+            lruBlockMessages.clear();
+            mapBlockMessages.clear();
+            nBlockMessagesSize = 0;
+            fBlockMessagesNewMagic = fNewMagic;
+        }
+        map<uint256, list<pair<uint256, CSendBuffer> >::iterator>::iterator mi = mapBlockMessages.find(hash);
+        if (mi != mapBlockMessages.end())
+        {
+            lruBlockMessages.splice(lruBlockMessages.begin(), lruBlockMessages, (*mi).second);
+            return (*mi).second->second;
+        }
+    }
+
+    CSendBuffer msg;
+    if (!ReadBlockMessageFromDisk(pindex, msg))
+        return CSendBuffer();
+
+    LOCK(cs_mapBlockMessages);
+    if (mapBlockMessages.count(hash) || fBlockMessagesNewMagic != fNewMagic)
+        return msg;
+    lruBlockMessages.push_front(make_pair(hash, msg));
+    mapBlockMessages[hash] = lruBlockMessages.begin();
+    nBlockMessagesSize += msg->size();
+
+    size_t nMaxSize = GetArg("-maxblockcache", 8*1000)*1000;
+    while (nBlockMessagesSize > nMaxSize && !lruBlockMessages.empty())
+    {
+        nBlockMessagesSize -= lruBlockMessages.back().second->size();
+        mapBlockMessages.erase(lruBlockMessages.back().first);
+        lruBlockMessages.pop_back();
+    }
+    return msg;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     static map<CService, CPubKey> mapReuseKey;
@@ -2695,15 +4101,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
         }
 
-        // Ask the first connected node for block updates
+        pfrom->nSyncHeight = pfrom->nStartingHeight;
+
+        // Ask the first connected node for headers; blocks are then
+        // downloaded from all nodes
         static int nAskedForBlocks = 0;
+        unsigned int nNodes;
+        {
+            LOCK(cs_vNodes);
+            nNodes = vNodes.size();
+        }
         if (!pfrom->fClient && !pfrom->fOneShot &&
             (pfrom->nVersion < NOBLKS_VERSION_START ||
              pfrom->nVersion >= NOBLKS_VERSION_END) &&
-             (nAskedForBlocks < 1 || vNodes.size() <= 1))
+             (nAskedForBlocks < 1 || nNodes <= 1))
         {
             nAskedForBlocks++;
-            pfrom->PushGetBlocks(pindexBest, uint256(0));
+            pfrom->PushGetHeaders(pindexBestHeader, uint256(0));
         }
 
         // Relay alerts
@@ -2731,7 +4145,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->nRecvVersion = min(pfrom->nVersion, PROTOCOL_VERSION);
     }
 
 
@@ -2833,16 +4247,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave)
+            if (inv.type == MSG_BLOCK && !fAlreadyHave) {
+                // Blocks are fetched off the header chain; get the headers
+                // leading to it, unless we have them already
+                CBlockIndexMap::iterator mi = mapHeaderIndex.find(inv.hash);
+                if (mi == mapHeaderIndex.end())
+                    pfrom->PushGetHeaders(pindexBestHeader, inv.hash);
+                else
+                    pfrom->nSyncHeight = max(pfrom->nSyncHeight, (*mi).second->nHeight);
+            } else if (!fAlreadyHave)
                 pfrom->AskFor(inv);
             else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
-            } else if (nInv == nLastBlock) {
+                pfrom->PushGetHeaders(pindexBestHeader, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+            } else if (nInv == nLastBlock && mapBlockIndex.count(inv.hash)) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
-                // this situation and push another getblocks to continue.
-                std::vector<CInv> vGetData(1,inv);
-                pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
+                // this situation and ask for the headers after it.
+                pfrom->PushGetHeaders(mapBlockIndex[inv.hash], uint256(0));
                 if (fDebug)
                     printf("force request: %s\n", inv.ToString().c_str());
             }
@@ -2875,13 +4296,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             if (inv.type == MSG_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Send block from disk.  Only the lookup needs cs_main; index
+                // entries are never freed and their disk position doesn't
+                // change.
+                CBlockIndex* pindex = NULL;
+                uint256 hashBest;
+                {
+                    LOCK(cs_main);
+                    CBlockIndexMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                        pindex = (*mi).second;
+                    hashBest = hashBestChain;
+                }
+                CSendBuffer msgBlock;
+                if (pindex)
+                    msgBlock = GetBlockMessage(pindex);
+                if (msgBlock)
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    pfrom->PushSharedMessage(msgBlock);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -2890,7 +4322,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -2957,7 +4389,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -2983,6 +4415,40 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %d", vHeaders.size());
+        }
+
+        PrecomputePoWHashes(vHeaders);
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+        {
+            if (!AcceptHeader(header, pindexLast))
+            {
+                if (header.nDoS) pfrom->Misbehaving(header.nDoS);
+                pindexLast = NULL;
+                break;
+            }
+        }
+
+        if (pindexLast)
+        {
+            printf("received %d headers up to height %d, best header height %d\n", (int)vHeaders.size(), pindexLast->nHeight, pindexBestHeader->nHeight);
+            pfrom->nSyncHeight = max(pfrom->nSyncHeight, pindexLast->nHeight);
+
+            // A full batch means there are more
+            if (vHeaders.size() == MAX_HEADERS_RESULTS)
+                pfrom->PushGetHeaders(pindexLast, uint256(0));
+        }
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3063,6 +4529,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        mapBlocksInFlight.erase(inv.hash);
+        pfrom->mapBlocksInFlight.erase(inv.hash);
+        CBlockIndexMap::iterator mi = mapHeaderIndex.find(inv.hash);
+        if (mi != mapHeaderIndex.end())
+            pfrom->nSyncHeight = max(pfrom->nSyncHeight, (*mi).second->nHeight);
+
         if (ProcessBlock(pfrom, &block))
             mapAlreadyAskedFor.erase(inv);
         if (block.nDoS) pfrom->Misbehaving(block.nDoS);
@@ -3071,7 +4543,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -3180,143 +4655,200 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
-bool ProcessMessages(CNode* pfrom)
+//
+// Message format
+//  (4) message start
+//  (12) command
+//  (4) size
+//  (4) checksum
+//  (x) data
+//
+
+static bool IsMessageStart(const char* pch, unsigned int nLen)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
+    return memcmp(pch, pchMessageStart, nLen) == 0 || memcmp(pch, pchMessageStart2, nLen) == 0;
+}
+
+// Parse the header assembled in pfrom->pchRecvHeader and start receiving its
+// payload.  Headers that don't check out are dropped and the stream resynced
+// on the next message start, like the old scan of the receive buffer.
+static bool StartMessage(CNode* pfrom)
+{
+    const unsigned int nHeaderSize = CMessageHeader::HEADER_SIZE;
+    char* pchHeader = pfrom->pchRecvHeader;
+
+    if (!IsMessageStart(pchHeader, CMessageHeader::MESSAGE_START_SIZE))
+    {
+        // Skip to the first place a message start could begin, which may be
+        // a partial one at the tail of what we have
+        unsigned int nSkip = 1;
+        for (; nSkip < nHeaderSize; nSkip++)
+            if (IsMessageStart(&pchHeader[nSkip], min(nHeaderSize - nSkip, (unsigned int)CMessageHeader::MESSAGE_START_SIZE)))
+                break;
+        printf("\n\nPROCESSMESSAGE SKIPPED %u BYTES\n\n", nSkip);
+        memmove(pchHeader, &pchHeader[nSkip], nHeaderSize - nSkip);
+        pfrom->nRecvHeaderPos -= nSkip;
         return true;
+    }
+    pfrom->nRecvHeaderPos = 0;
 
-    if (fDebug){
-        printf("=============================================================\n");
-        printf("ProcessMessages(%u bytes)\n", vRecv.size());
-        printf("From Node Address: %s\n",pfrom->addr.ToString().c_str());
-        printf("From Node Direction: %s\n",(pfrom->fInbound)?"Inbound":"Outbound");
-        printf("Node Starting height: %d\n",pfrom->nStartingHeight);
-        printf("Node MessageStart: %x\n",pfrom->nMessageStart);
-        printf("From Node HeaderStart: %x\n",pfrom->nHeaderStart);
-        printf("Node Version: %d\n",pfrom->nVersion);
-        //printf("Node Port: %s\n",pfrom->addr.ToStringPort().c_str());
-        printf("My nBestHeight: %d\n",nBestHeight);
+    int magic = MAGIC_NUM_SWITCH_HEIGHT + (memcmp(pchHeader, pchMessageStart2, sizeof(pchMessageStart2)) == 0 ? 1 : 0);
+    CMessageHeader hdr(magic);
+    CDataStream ssHeader(pchHeader, pchHeader + nHeaderSize, SER_NETWORK, pfrom->nRecvVersion);
+    ssHeader >> hdr;
+    if (!hdr.IsValid(magic))
+    {
+        printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
+        return true;
+    }
 
+    // A message that can't fit in the receive buffer would never have been
+    // framed by the old code either
+    if (hdr.nMessageSize > ReceiveBufferSize())
+    {
+        if (!pfrom->fDisconnect)
+            printf("socket recv flood control disconnect (%s, %u bytes)\n", hdr.GetCommand().c_str(), hdr.nMessageSize);
+        return false;
     }
 
-    //
-    // Message format
-    //  (4) message start
-    //  (12) command
-    //  (4) size
-    //  (4) checksum
-    //  (x) data
-    //
+    pfrom->vRecvPartial.push_back(CNetMessage(hdr.GetCommand(), SER_NETWORK, pfrom->nRecvVersion));
+    CNetMessage& msg = pfrom->vRecvPartial.back();
+    msg.nMessageSize = hdr.nMessageSize;
+    msg.nChecksum = hdr.nChecksum;
+    return true;
+}
 
-    int magic=0;
-    loop
+// Check the checksum of the completed payload in place and move the message
+// onto vRecvMsg without copying it
+static void FinishMessage(CNode* pfrom, list<CNetMessage>& vRecvMsg, unsigned int& nRecvMsgBytes)
+{
+    CNetMessage& msg = pfrom->vRecvPartial.front();
+    msg.vRecv.resize(msg.nMessageSize);
+
+    uint256 hash = Hash(msg.vRecv.begin(), msg.vRecv.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    if (nChecksum != msg.nChecksum)
     {
-        magic = 0;
-        if(fDebug){ printf("---- loop top -----------------\n");}
-        // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->vSend.size() >= SendBufferSize())
-            break;
+        printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
+           msg.strCommand.c_str(), msg.nMessageSize, nChecksum, msg.nChecksum);
+        pfrom->vRecvPartial.clear();
+        return;
+    }
 
-        CDataStream::iterator pstart;
-        CDataStream::iterator tstart;
-        CDataStream::iterator xstart;
-
-        tstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        xstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart2), END(pchMessageStart2));
-
-        int t=vRecv.end()-tstart;
-        int x=vRecv.end()-xstart;
-        // Scan for message start
-        if(fDebug){
-            printf("::pre:: Height: %d\n",nBestHeight);
-            printf("t =  %d\n",t);
-            printf("x = %d\n",x);
-         }
-
-
-        if(x > 0){
-            pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart2), END(pchMessageStart2));
-            magic = 1;
-        }else if( t > 0){
-            pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-            magic = 0;
-        }else{
-            pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart2), END(pchMessageStart2));
-        }
+    nRecvMsgBytes += CMessageHeader::HEADER_SIZE + msg.nMessageSize;
+    vRecvMsg.splice(vRecvMsg.end(), pfrom->vRecvPartial);
+}
 
-        magic = magic + MAGIC_NUM_SWITCH_HEIGHT;
+// Frame nBytes just read from pfrom's socket and queue the complete messages
+// on pfrom->vRecvMsg.  pch is NULL if the bytes were read straight into the
+// window from GetRecvWindow.  Each byte is looked at once: headers are parsed
+// as they complete and payloads land directly in their message.  Called by
+// the socket thread with cs_vRecv held; returns false if the peer should be
+// disconnected.
+bool FrameMessages(CNode* pfrom, const char* pch, unsigned int nBytes, bool& fQueued)
+{
+    const unsigned int nHeaderSize = CMessageHeader::HEADER_SIZE;
+    list<CNetMessage> vRecvMsg;
+    unsigned int nRecvMsgBytes = 0;
 
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader(magic));
-        if(fDebug){ printf("Got SerializeSize: %d\n",nHeaderSize);}
-        if(fDebug){
-            int vr = vRecv.end() - pstart;
-            printf("vr= %d, nHeaderSize= %d\n",vr,nHeaderSize);
+    if (pch == NULL)
+    {
+        CNetMessage& msg = pfrom->vRecvPartial.front();
+        msg.nDataPos += nBytes;
+        if (msg.IsComplete())
+            FinishMessage(pfrom, vRecvMsg, nRecvMsgBytes);
+        nBytes = 0;
+    }
 
-        }
-        if (vRecv.end() - pstart < nHeaderSize)
+    while (nBytes > 0)
+    {
+        if (pfrom->vRecvPartial.empty())
         {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
-            if(fDebug){printf("vRecv.end() - pstart < nHeadersize(%d)...breaking.\n",nHeaderSize);}
-            break;
+            unsigned int nCopy = min(nHeaderSize - pfrom->nRecvHeaderPos, nBytes);
+            memcpy(&pfrom->pchRecvHeader[pfrom->nRecvHeaderPos], pch, nCopy);
+            pfrom->nRecvHeaderPos += nCopy;
+            pch += nCopy;
+            nBytes -= nCopy;
+            if (pfrom->nRecvHeaderPos < nHeaderSize)
+                break;
+            if (!StartMessage(pfrom))
+                return false;
         }
-        if(fDebug){ printf("Found messagesstart\n");}
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %d BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
-        if(fDebug){ printf("saving off header...\n");}
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        if(fDebug){ printf("Creating new header...\n");}
-        CMessageHeader hdr(magic);
-        vRecv >> hdr;
-        if(fDebug){ printf("Checking for valid header.(%x)\n",hdr.pchMessageStart[0]);}
-        if (!hdr.IsValid(magic))
+        else
         {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
+            CNetMessage& msg = pfrom->vRecvPartial.front();
+            unsigned int nCopy = min(msg.nMessageSize - msg.nDataPos, nBytes);
+            if (msg.vRecv.size() < msg.nDataPos + nCopy)
+                msg.vRecv.resize(msg.nDataPos + nCopy);
+            memcpy(&msg.vRecv[msg.nDataPos], pch, nCopy);
+            msg.nDataPos += nCopy;
+            pch += nCopy;
+            nBytes -= nCopy;
         }
-        if(fDebug){ printf("Block: %d, Validated\n", nBestHeight); }
 
-        string strCommand = hdr.GetCommand();
+        // Zero length payloads are complete as soon as the header is
+        if (!pfrom->vRecvPartial.empty() && pfrom->vRecvPartial.front().IsComplete())
+            FinishMessage(pfrom, vRecvMsg, nRecvMsgBytes);
+    }
 
-        // Message size
-        unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
+    fQueued = !vRecvMsg.empty();
+    if (!fQueued)
+        return true;
+    {
+        LOCK(pfrom->cs_vRecvMsg);
+        pfrom->vRecvMsg.splice(pfrom->vRecvMsg.end(), vRecvMsg);
+        pfrom->nRecvMsgBytes += nRecvMsgBytes;
+    }
+    return true;
+}
 
-        // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
-        {
-            printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
-            continue;
-        }
+bool ProcessMessages(CNode* pfrom)
+{
+    // Take the queued messages; whatever isn't processed goes back
+    list<CNetMessage> vRecvMsg;
+    {
+        LOCK(pfrom->cs_vRecvMsg);
+        if (pfrom->vRecvMsg.empty())
+            return false;
+        vRecvMsg.splice(vRecvMsg.end(), pfrom->vRecvMsg);
+    }
+
+    // Scrypt any blocks among them on the verification threads
+    PrecomputeQueuedBlockPoW(vRecvMsg);
+
+    if (fDebug){
+        printf("=============================================================\n");
+        printf("ProcessMessages(%u messages)\n", (unsigned int)vRecvMsg.size());
+        printf("From Node Address: %s\n",pfrom->addr.ToString().c_str());
+        printf("From Node Direction: %s\n",(pfrom->fInbound)?"Inbound":"Outbound");
+        printf("Node Starting height: %d\n",pfrom->nStartingHeight);
+        printf("Node Version: %d\n",pfrom->nVersion);
+        printf("My nBestHeight: %d\n",nBestHeight);
+    }
+
+    bool fProcessed = false;
+    while (!vRecvMsg.empty())
+    {
+        // Don't bother if send buffer is too full to respond anyway
+        if (pfrom->nSendSize >= SendBufferSize())
+            break;
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
+        CNetMessage& msg = vRecvMsg.front();
+        string strCommand = msg.strCommand;
+        CDataStream& vMsg = msg.vRecv;
+        unsigned int nMessageSize = vMsg.size();
+        const unsigned int nHeaderSize = CMessageHeader::HEADER_SIZE;
+        // The version in effect when the message is processed, not framed
+        vMsg.SetVersion(pfrom->nRecvVersion);
 
         // Process message
         bool fRet = false;
         try
         {
+            if (!MessageNeedsChainLock(strCommand))
+                fRet = ProcessMessage(pfrom, strCommand, vMsg);
+            else
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
@@ -3349,24 +4881,21 @@ bool ProcessMessages(CNode* pfrom)
 
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
-    }
 
-    vRecv.Compact();
-    if (fDebug){
-        printf("=== EOR =====================================================\n");
-        printf("ProcessMessages(%u bytes)\n", vRecv.size());
-        printf("From Node Address: %s\n",pfrom->addr.ToString().c_str());
-        printf("From Node Direction: %s\n",(pfrom->fInbound)?"Inbound":"Outbound");
-        printf("Node Starting height: %d\n",pfrom->nStartingHeight);
-        printf("Node MessageStart: %x\n",pfrom->nMessageStart);
-        printf("From Node HeaderStart: %x\n",pfrom->nHeaderStart);
-        printf("Node Version: %d\n",pfrom->nVersion);
-        //printf("Node Port: %s\n",pfrom->addr.ToStringPort().c_str());
-        printf("My nBestHeight: %d\n",nBestHeight);
-        printf("\n***** Exiting Process Message *****\n");
+        vRecvMsg.pop_front();
+        {
+            LOCK(pfrom->cs_vRecvMsg);
+            pfrom->nRecvMsgBytes -= nHeaderSize + nMessageSize;
+        }
+        fProcessed = true;
+    }
 
+    if (!vRecvMsg.empty())
+    {
+        LOCK(pfrom->cs_vRecvMsg);
+        pfrom->vRecvMsg.splice(pfrom->vRecvMsg.begin(), vRecvMsg);
     }
-    return true;
+    return fProcessed;
 }
 
 
@@ -3380,7 +4909,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
         // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
         // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty()) {
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
             uint64 nonce = 0;
             if (pto->nVersion > BIP0031_VERSION)
                 pto->PushMessage("ping", nonce);
@@ -3401,7 +4930,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_vAddrToSend);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -3420,23 +4952,29 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            vector<CAddress> vAddrNew;
+            {
+                LOCK(pto->cs_vAddrToSend);
+                vAddrNew.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+                {
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddrNew.push_back(addr);
+                }
+                pto->vAddrToSend.clear();
+            }
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            BOOST_FOREACH(const CAddress& addr, vAddrNew)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                vAddr.push_back(addr);
+                // receiver rejects addr messages larger than 1000
+                if (vAddr.size() >= 1000)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    pto->PushMessage("addr", vAddr);
+                    vAddr.clear();
                 }
             }
-            pto->vAddrToSend.clear();
             if (!vAddr.empty())
                 pto->PushMessage("addr", vAddr);
         }
@@ -3504,6 +5042,18 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
+        RequestBlocks(pto, vGetData);
+
+        // Ask again for headers if the peer has blocks beyond ours and the
+        // header sync has stalled
+        static int64 nLastAskedForHeaders;
+        if (pindexBestHeader && pto->nSyncHeight > pindexBestHeader->nHeight && !pto->fClient &&
+            GetTime() - nTimeBestHeader > BLOCK_DOWNLOAD_TIMEOUT && GetTime() - nLastAskedForHeaders > BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            nLastAskedForHeaders = GetTime();
+            pto->PushGetHeaders(pindexBestHeader, uint256(0));
+        }
+
         int64 nNow = GetTime() * 1000000;
         CTxDB txdb("r");
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
@@ -3617,192 +5167,257 @@ unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1
     }
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64 nLastBlockTx = 0;
+uint64 nLastBlockSize = 0;
+
+/** The block every miner and mining RPC works from.  Built from the memory
+ * pool once per best block, then extended as transactions arrive.  The
+ * coinbase has no output script; each caller puts in its own. */
+class CBlockTemplate
 {
 public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-
-    COrphan(CTransaction* ptxIn)
+    CBlock block;
+    std::vector<int64> vTxFees;   // per transaction in block.vtx
+    std::vector<int64> vTxSigOps;
+    CBlockIndex* pindexPrev;
+    uint64 nBlockSize;
+    int nBlockSigOps;
+    int64 nFees;
+    std::set<uint256> setTx;       // transactions in block.vtx
+    std::set<COutPoint> setSpent;  // outputs they spend
+    std::set<uint256> setRejected; // pool transactions that didn't fit
+
+    CBlockTemplate(CBlockIndex* pindexPrevIn)
     {
-        ptx = ptxIn;
-        dPriority = 0;
-    }
+        pindexPrev = pindexPrevIn;
+        nBlockSize = 1000;
+        nBlockSigOps = 100;
+        nFees = 0;
 
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f)\n", ptx->GetHash().ToString().substr(0,10).c_str(), dPriority);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
+        CTransaction txNew;
+        txNew.vin.resize(1);
+        txNew.vin[0].prevout.SetNull();
+        txNew.vout.resize(1);
+        block.vtx.push_back(txNew);
+        vTxFees.push_back(0);
+        vTxSigOps.push_back(0);
     }
 };
 
+static CCriticalSection cs_blockTemplate;
+static CBlockTemplate* pblocktemplate = NULL;
+static unsigned int nTemplateTransactionsUpdated = 0;
+static int64 nTemplateTime = 0;
 
-uint64 nLastBlockTx = 0;
-uint64 nLastBlockSize = 0;
-
-CBlock* CreateNewBlock(CReserveKey& reservekey)
+// Append a pool transaction to the template if it fits and pays enough.
+// view holds the coins it spends as the template so far leaves them.
+static bool AddToBlockTemplate(CBlockTemplate& tmpl, CCoinsCache& view, const uint256& hash, CTransaction& tx, CTxMemPoolEntry& entry)
 {
-    CBlockIndex* pindexPrev = pindexBest;
+    if (tx.IsCoinBase() || !tx.IsFinal())
+        return false;
+    double dPriority = entry.GetPriority(tmpl.pindexPrev->nHeight);
 
-    // Create new block
-    auto_ptr<CBlock> pblock(new CBlock());
-    if (!pblock.get())
-        return NULL;
+    if (fDebug && GetBoolArg("-printpriority"))
+        printf("priority %-20.1f feerate %-12.1f %s\n", dPriority, entry.GetFeeRate(), hash.ToString().substr(0,10).c_str());
+
+    // Size limits
+    unsigned int nTxSize = entry.nTxSize;
+    if (tmpl.nBlockSize + nTxSize >= MAX_BLOCK_SIZE_GEN)
+        return false;
 
-    // Create coinbase tx
-    CTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey << reservekey.GetReservedKey() << OP_CHECKSIG;
+    // Legacy limits on sigOps:
+    unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+    if (tmpl.nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
 
-    // Add our coinbase tx as first transaction
-    pblock->vtx.push_back(txNew);
+    // Transaction fee required depends on block size
+    // sexcoind: Reduce the exempted free transactions to 500 bytes (from Bitcoin's 3000 bytes)
+    bool fAllowFree = (tmpl.nBlockSize + nTxSize < 1500 || CTransaction::AllowFree(dPriority));
+    int64 nMinFee = tx.GetMinFee(tmpl.nBlockSize, fAllowFree, GMF_BLOCK);
+
+    // Connecting shouldn't fail due to dependency on other memory pool transactions
+    // because we're already processing them in order of dependency
+    CCoinsCache viewTmp(view);
+    MapPrevTx mapInputs;
+    bool fInvalid;
+    if (!tx.FetchInputs(viewTmp, false, true, mapInputs, fInvalid))
+        return false;
 
-    // Collect memory pool transactions into the block
-    int64 nFees = 0;
+    int64 nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+    if (nTxFees < nMinFee)
+        return false;
+
+    nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
+    if (tmpl.nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    // Signatures only need checking if it entered the pool unchecked
+    if (!tx.ConnectInputs(mapInputs, viewTmp, tmpl.pindexPrev, false, true, true, !entry.fScriptsChecked))
+        return false;
+    entry.fScriptsChecked = true;
+    viewTmp.SetCoins(hash, CCoins(tx, tmpl.pindexPrev->nHeight + 1));
+    viewTmp.Flush();
+
+    // Added
+    tmpl.block.vtx.push_back(tx);
+    tmpl.vTxFees.push_back(nTxFees);
+    tmpl.vTxSigOps.push_back(nTxSigOps);
+    tmpl.nBlockSize += nTxSize;
+    tmpl.nBlockSigOps += nTxSigOps;
+    tmpl.nFees += nTxFees;
+    tmpl.setTx.insert(hash);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        tmpl.setSpent.insert(txin.prevout);
+    return true;
+}
+
+static CBlockTemplate* BuildBlockTemplate(CBlockIndex* pindexPrev)
+{
+    CBlockTemplate* ptmpl = new CBlockTemplate(pindexPrev);
     {
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        multimap<double, CTransaction*> mapPriority;
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        CCoinsCache view(txdb);
+
+        // Walk the pool best first.  A transaction waits until the ones it
+        // spends from the pool are in; then it competes from a second queue
+        // with the rest of the walk.
+        set<CTxMemPoolRank>::iterator itRank = mempool.setRank.begin();
+        set<CTxMemPoolRank> setReady;
+        set<uint256> setDone;
+        loop
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            // Take the better of the next in the walk and the best ready child
+            while (itRank != mempool.setRank.end() && setDone.count((*itRank).hash))
+                ++itRank;
+            uint256 hash;
+            if (!setReady.empty() && (itRank == mempool.setRank.end() || *setReady.begin() < *itRank))
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    continue;
-                }
-                int64 nValueIn = txPrev.vout[txin.prevout.n].nValue;
-
-                // Read block header
-                int nConf = txindex.GetDepthInMainChain();
-
-                dPriority += (double)nValueIn * nConf;
-
-                if (fDebug && GetBoolArg("-printpriority"))
-                    printf("priority     nValueIn=%-12"PRI64d" nConf=%-5d dPriority=%-20.1f\n", nValueIn, nConf, dPriority);
+                hash = (*setReady.begin()).hash;
+                setReady.erase(setReady.begin());
             }
-
-            // Priority is sum(valuein * age) / txsize
-            dPriority /= ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-
-            if (porphan)
-                porphan->dPriority = dPriority;
-            else
-                mapPriority.insert(make_pair(-dPriority, &(*mi).second));
-
-            if (fDebug && GetBoolArg("-printpriority"))
+            else if (itRank != mempool.setRank.end())
             {
-                printf("priority %-20.1f %s\n%s", dPriority, tx.GetHash().ToString().substr(0,10).c_str(), tx.ToString().c_str());
-                if (porphan)
-                    porphan->print();
-                printf("\n");
+                hash = (*itRank).hash;
+                ++itRank;
             }
-        }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64 nBlockSize = 1000;
-        uint64 nBlockTx = 0;
-        int nBlockSigOps = 100;
-        while (!mapPriority.empty())
-        {
-            // Take highest priority transaction off priority queue
-            double dPriority = -(*mapPriority.begin()).first;
-            CTransaction& tx = *(*mapPriority.begin()).second;
-            mapPriority.erase(mapPriority.begin());
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= MAX_BLOCK_SIZE_GEN)
+            else
+                break;
+            if (setDone.count(hash))
                 continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            CTxMemPoolEntry& entry = mempool.mapEntry[hash];
+            bool fReady = true;
+            BOOST_FOREACH(const uint256& hashParent, entry.setDepends)
+                if (!setDone.count(hashParent))
+                    fReady = false;
+            if (!fReady)
                 continue;
+            setDone.insert(hash);
 
-            // Transaction fee required depends on block size
-            // sexcoind: Reduce the exempted free transactions to 500 bytes (from Bitcoin's 3000 bytes)
-            bool fAllowFree = (nBlockSize + nTxSize < 1500 || CTransaction::AllowFree(dPriority));
-            int64 nMinFee = tx.GetMinFee(nBlockSize, fAllowFree, GMF_BLOCK);
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            if (!AddToBlockTemplate(*ptmpl, view, hash, mempool.mapTx[hash], entry))
+            {
+                ptmpl->setRejected.insert(hash);
                 continue;
+            }
 
-            int64 nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
-                continue;
+            // Children whose pool parents are all in now can go
+            BOOST_FOREACH(const uint256& hashChild, entry.setSpentBy)
+                if (!setDone.count(hashChild))
+                    setReady.insert(CTxMemPoolRank(hashChild, mempool.mapEntry[hashChild]));
+        }
 
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+        nLastBlockTx = ptmpl->block.vtx.size() - 1;
+        nLastBlockSize = ptmpl->nBlockSize;
+        printf("CreateNewBlock(): total size %"PRI64u"\n", ptmpl->nBlockSize);
+    }
+    return ptmpl;
+}
 
-            if (!tx.ConnectInputs(mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                            mapPriority.insert(make_pair(-porphan->dPriority, porphan->ptx));
-                    }
-                }
-            }
+// Append the transactions that have entered the pool since the template was
+// built.  Only their own inputs are looked up.
+static void ExtendBlockTemplate(CBlockTemplate& tmpl)
+{
+    LOCK2(cs_main, mempool.cs);
+    CTxDB txdb("r");
+    CCoinsCache view(txdb);
+    unsigned int nAdded = 0;
+    BOOST_FOREACH(const CTxMemPoolRank& rank, mempool.setRank)
+    {
+        const uint256& hash = rank.hash;
+        if (tmpl.setTx.count(hash) || tmpl.setRejected.count(hash))
+            continue;
+        CTxMemPoolEntry& entry = mempool.mapEntry[hash];
+        bool fReady = true;
+        BOOST_FOREACH(const uint256& hashParent, entry.setDepends)
+            if (!tmpl.setTx.count(hashParent))
+                fReady = false;
+        if (!fReady)
+            continue;
+
+        // The view doesn't know what the template spends
+        CTransaction& tx = mempool.mapTx[hash];
+        bool fConflict = false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (tmpl.setSpent.count(txin.prevout))
+                fConflict = true;
+        if (fConflict)
+        {
+            tmpl.setRejected.insert(hash);
+            continue;
+        }
+        BOOST_FOREACH(const uint256& hashParent, entry.setDepends)
+        {
+            CCoins coins(mempool.mapTx[hashParent], tmpl.pindexPrev->nHeight + 1);
+            for (set<COutPoint>::iterator it = tmpl.setSpent.lower_bound(COutPoint(hashParent, 0)); it != tmpl.setSpent.end() && (*it).hash == hashParent; ++it)
+                coins.Spend((*it).n);
+            view.SetCoins(hashParent, coins);
         }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        printf("CreateNewBlock(): total size %lu\n", nBlockSize);
+        if (AddToBlockTemplate(tmpl, view, hash, tx, entry))
+            nAdded++;
+        else
+            tmpl.setRejected.insert(hash);
+    }
+
+    nLastBlockTx = tmpl.block.vtx.size() - 1;
+    nLastBlockSize = tmpl.nBlockSize;
+    if (nAdded > 0)
+        printf("CreateNewBlock(): added %u transactions, total size %"PRI64u"\n", nAdded, tmpl.nBlockSize);
+}
+
+CBlock* CreateNewBlock(CReserveKey& reservekey, std::vector<int64>* pvTxFees, std::vector<int64>* pvTxSigOps)
+{
+    LOCK2(cs_main, cs_blockTemplate);
+    CBlockIndex* pindexPrev = pindexBest;
 
+    // Bring the shared template up to date: rebuilt for a new best block,
+    // and now and then to re-rank, otherwise just extended
+    unsigned int nTransactionsUpdatedNow = nTransactionsUpdated;
+    if (!pblocktemplate || pblocktemplate->pindexPrev != pindexPrev ||
+        (nTransactionsUpdatedNow != nTemplateTransactionsUpdated && GetTime() - nTemplateTime > 60))
+    {
+        delete pblocktemplate;
+        pblocktemplate = NULL;
+        nTemplateTime = GetTime();
+        pblocktemplate = BuildBlockTemplate(pindexPrev);
     }
-    pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+    else if (nTransactionsUpdatedNow != nTemplateTransactionsUpdated)
+        ExtendBlockTemplate(*pblocktemplate);
+    nTemplateTransactionsUpdated = nTransactionsUpdatedNow;
+
+    // Create new block
+    auto_ptr<CBlock> pblock(new CBlock(pblocktemplate->block));
+    if (!pblock.get())
+        return NULL;
+    if (pvTxFees)
+        *pvTxFees = pblocktemplate->vTxFees;
+    if (pvTxSigOps)
+        *pvTxSigOps = pblocktemplate->vTxSigOps;
+
+    // Our coinbase
+    pblock->vtx[0].vout[0].scriptPubKey << reservekey.GetReservedKey() << OP_CHECKSIG;
+    pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, pblocktemplate->nFees);
 
     // Fill in header
     pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
@@ -3815,6 +5430,39 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
 }
 
 
+// WaitForNewWork runs without cs_main, so it watches copies of the best
+// block and the memory pool counter, taken under mutexNewWork
+static boost::mutex mutexNewWork;
+static boost::condition_variable condNewWork;
+static uint256 hashNewWorkBest;
+static unsigned int nNewWorkTransactionsUpdated;
+
+// Called with cs_main held
+void NotifyNewWork()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexNewWork);
+        hashNewWorkBest = hashBestChain;
+        nNewWorkTransactionsUpdated = nTransactionsUpdated;
+    }
+    condNewWork.notify_all();
+}
+
+void WaitForNewWork(const uint256& hashPrev, unsigned int nTransactionsUpdatedLast)
+{
+    int64 nStart = GetTime();
+    boost::unique_lock<boost::mutex> lock(mutexNewWork);
+    while (!fShutdown)
+    {
+        if (hashNewWorkBest != hashPrev)
+            return;
+        // Not every transaction is worth waking the miners for
+        if (nNewWorkTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart >= 60)
+            return;
+        condNewWork.timed_wait(lock, boost::posix_time::seconds(1));
+    }
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -3881,7 +5529,7 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     uint256 hash = pblock->GetPoWHash();
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     if (hash > hashTarget)
         return false;
@@ -3933,6 +5581,14 @@ void static BitcoinMiner(CWallet *pwallet)
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
 
+    // Scratchpad and header/hash buffers sized for the widest scrypt kernel
+    int nWays = scrypt_best_throughput();
+    std::vector<char> vScratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    char* scratchpad = &vScratchpad[0];
+    char pheaders[80 * SCRYPT_MAX_WAYS];
+    char phashes[32 * SCRYPT_MAX_WAYS];
+    printf("SXCMiner using %d-way scrypt\n", nWays);
+
     while (fGenerateBitcoins)
     {
         if (fShutdown)
@@ -3979,29 +5635,51 @@ void static BitcoinMiner(CWallet *pwallet)
         // Search
         //
         int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
         loop
         {
             unsigned int nHashesDone = 0;
-            //unsigned int nNonceFound;
+            unsigned int nNonceFound = 0;
 
             uint256 thash;
-            char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+            bool fFound = false;
             loop
             {
-                scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
+                // Hash nWays consecutive nonces per pass; nWays is 1, 4 or 8,
+                // so the batches still line up with the 0xFF boundary below.
+                for (int i = 0; i < nWays; i++)
+                {
+                    unsigned int nNonce = pblock->nNonce + i;
+                    memcpy(pheaders + 80 * i, BEGIN(pblock->nVersion), 80);
+                    memcpy(pheaders + 80 * i + 76, &nNonce, 4);
+                }
+                scrypt_1024_1_1_256_sp_multi(pheaders, phashes, scratchpad, nWays);
 
-                if (thash <= hashTarget)
+                for (int i = 0; i < nWays; i++)
+                {
+                    memcpy(BEGIN(thash), phashes + 32 * i, 32);
+                    if (thash <= hashTarget)
+                    {
+                        // Found a solution
+                        nNonceFound = pblock->nNonce + i;
+                        fFound = true;
+                        break;
+                    }
+                }
+                if (fFound)
                 {
-                    // Found a solution
+                    // Submit the solution, then go on from the next batch
+                    // so the nonce stays a multiple of nWays
+                    unsigned int nNonceBatch = pblock->nNonce;
+                    pblock->nNonce = nNonceFound;
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
                     CheckWork(pblock.get(), *pwalletMain, reservekey);
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                    break;
+                    pblock->nNonce = nNonceBatch;
                 }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
+                pblock->nNonce += nWays;
+                nHashesDone += nWays;
+                if (fFound || (pblock->nNonce & 0xFF) == 0)
                     break;
             }
 
@@ -4059,7 +5737,7 @@ void static BitcoinMiner(CWallet *pwallet)
             {
                 // Changing pblock->nTime can change work required on testnet:
                 nBlockBits = ByteReverse(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                hashTarget = uint256().SetCompact(pblock->nBits);
             }
         }
     }
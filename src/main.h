@@ -16,6 +16,8 @@
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -70,6 +72,20 @@ static const int64 MIN_RELAY_TX_FEE = MIN_TX_FEE;
 static const int64 MAX_MONEY = 250000000 * COIN; // Sexcoin: maximum of 250000000 coins
 inline bool MoneyRange(int64 nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
 static const int COINBASE_MATURITY = 70;
+/** Height given to coins of memory pool transactions */
+static const int MEMPOOL_HEIGHT = 0x7FFFFFFF;
+/** Maximum number of block verification threads (-par) */
+static const int MAX_VERIFY_THREADS = 16;
+/** Headers sent in reply to one getheaders */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Headers kept off the best header chain, e.g. of stale or competing forks */
+static const unsigned int MAX_SIDE_HEADERS = 5 * MAX_HEADERS_RESULTS;
+/** How far past the best chain blocks of the best header chain are fetched */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Blocks requested from one outbound peer at a time (a quarter for inbound) */
+static const unsigned int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds a peer has to deliver a requested block */
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 60;
 // Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp.
 static const unsigned int LOCKTIME_THRESHOLD = 250000000; // Tue Nov  5 00:53:20 1985 UTC
 #ifdef USE_UPNP
@@ -86,15 +102,21 @@ extern CScript COINBASE_FLAGS;
 
 
 
+// Block index entries by block hash.  Node based, so phashBlock can point
+// at the key
+typedef boost::unordered_map<uint256, CBlockIndex*, CSaltedHasher> CBlockIndexMap;
+
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern CBlockIndexMap mapBlockIndex;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
-extern CBigNum bnBestChainWork;
-extern CBigNum bnBestInvalidWork;
+extern uint256 nBestChainWork;
+extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+extern CBlockIndexMap mapHeaderIndex;
+extern CBlockIndex* pindexBestHeader;
 extern unsigned int nTransactionsUpdated;
 extern uint64 nLastBlockTx;
 extern uint64 nLastBlockSize;
@@ -111,6 +133,8 @@ extern int nMaxHeightAccepted;
 // Settings
 extern int64 nTransactionFee;
 extern int64 nMinimumInputValue;
+extern int nVerifyThreads;
+extern int64 nCoinCacheSize;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64 nMinDiskSpace = 52428800;
@@ -119,6 +143,10 @@ static const uint64 nMinDiskSpace = 52428800;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CCoins;
+class CCoinsCache;
+class CTxUndo;
+class CScriptCheck;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
@@ -129,20 +157,38 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+CBlockIndex* NewBlockIndex();
+void FreeBlockIndex(CBlockIndex* pindex);
+void SetMainChainIndex(CBlockIndex* pindexNew);
+CBlockIndex* FindBlockByHeight(int nHeight);
+bool FrameMessages(CNode* pfrom, const char* pch, unsigned int nBytes, bool& fQueued);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
-CBlock* CreateNewBlock(CReserveKey& reservekey);
+CBlock* CreateNewBlock(CReserveKey& reservekey, std::vector<int64>* pvTxFees=NULL, std::vector<int64>* pvTxSigOps=NULL);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+// Wake anything waiting in WaitForNewWork; call with cs_main held
+void NotifyNewWork();
+// Wait until the best block isn't hashPrev any more, or the memory pool has
+// changed since nTransactionsUpdatedLast and the wait is a minute old
+void WaitForNewWork(const uint256& hashPrev, unsigned int nTransactionsUpdatedLast);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
+bool GetPrecomputedPoWHash(const uint256& hashBlock, uint256& hashPoW);
+void StartPoWCheckThreads();
+void StopPoWCheckThreads();
+void StartScriptCheckThreads();
+void StopScriptCheckThreads();
 unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlock *pblock);
 int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
+bool FlushCoinsCache(bool fForce=false);
+bool ReplayCoins(CBlockIndex* pindexCoins);
 
 
 
@@ -262,6 +308,11 @@ public:
     }
 };
 
+struct COutPointHasher : public CSaltedHasher
+{
+    size_t operator()(const COutPoint& outpoint) const { return Hash(outpoint.hash, outpoint.n); }
+};
+
 
 
 
@@ -375,7 +426,7 @@ public:
         scriptPubKey.clear();
     }
 
-    bool IsNull()
+    bool IsNull() const
     {
         return (nValue == -1);
     }
@@ -419,7 +470,7 @@ enum GetMinFee_mode
     GMF_SEND,
 };
 
-typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
+typedef std::map<uint256, CCoins> MapPrevTx;
 
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
@@ -690,36 +741,38 @@ public:
     bool ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txindexRet);
     bool ReadFromDisk(CTxDB& txdb, COutPoint prevout);
     bool ReadFromDisk(COutPoint prevout);
-    bool DisconnectInputs(CTxDB& txdb);
+    bool DisconnectInputs(CTxDB& txdb, CCoinsCache& view, const CTxUndo* ptxundo=NULL);
 
-    /** Fetch from memory and/or disk. inputsRet keys are transaction hashes.
+    /** Fetch the unspent outputs this transaction spends. inputsRet keys are
+        transaction hashes.
 
-     @param[in] txdb	Transaction database
-     @param[in] mapTestPool	List of pending changes to the transaction index database
+     @param[in] view	Coin database view, with any pending changes
      @param[in] fBlock	True if being called to add a new best-block to the chain
      @param[in] fMiner	True if being called by CreateNewBlock
-     @param[out] inputsRet	Pointers to this transaction's inputs
+     @param[out] inputsRet	Coins of this transaction's inputs
      @param[out] fInvalid	returns true if transaction is invalid
-     @return	Returns true if all inputs are in txdb or mapTestPool
+     @return	Returns true if all inputs are in view, or in the memory pool
+                when neither fBlock nor fMiner is set
      */
-    bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-                     bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+    bool FetchInputs(CCoinsCache& view, bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
 
-        @param[in] inputs	Previous transactions (from FetchInputs)
-        @param[out] mapTestPool	Keeps track of inputs that need to be updated on disk
-        @param[in] posThisTx	Position of this transaction on disk
+        @param[in] inputs	Previous transactions' coins (from FetchInputs)
+        @param[out] view	Receives the spent coins when fBlock or fMiner is set
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
         @param[in] fStrictPayToScriptHash	true if fully validating p2sh transactions
+        @param[in] fVerifyScripts	false to skip the signature checks, for inputs already verified
+        @param[out] pvChecks	if not NULL, signature checks are appended here instead of being run
+        @param[out] ptxundo	if not NULL, receives what is needed to undo the spends
         @return Returns true if all checks succeed
      */
-    bool ConnectInputs(MapPrevTx inputs,
-                       std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
+    bool ConnectInputs(MapPrevTx inputs, CCoinsCache& view,
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true,
+                       bool fVerifyScripts=true, std::vector<CScriptCheck> *pvChecks = NULL, CTxUndo* ptxundo = NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -730,6 +783,152 @@ protected:
 
 
 
+/** The unspent outputs of one transaction, as kept in the coin database.
+ * Spent outputs are nulled out so output indexes stay valid; once every
+ * output is spent the record is erased.
+ */
+class CCoins
+{
+public:
+    bool fCoinBase;
+    int nHeight;
+    std::vector<CTxOut> vout;
+
+    CCoins()
+    {
+        SetNull();
+    }
+
+    CCoins(const CTransaction& tx, int nHeightIn) : fCoinBase(tx.IsCoinBase()), nHeight(nHeightIn), vout(tx.vout) { }
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(fCoinBase);
+        READWRITE(nHeight);
+        READWRITE(vout);
+    )
+
+    void SetNull()
+    {
+        fCoinBase = false;
+        nHeight = 0;
+        vout.clear();
+    }
+
+    bool IsAvailable(unsigned int n) const
+    {
+        return (n < vout.size() && !vout[n].IsNull());
+    }
+
+    bool Spend(unsigned int n)
+    {
+        if (!IsAvailable(n))
+            return false;
+        vout[n].SetNull();
+        return true;
+    }
+
+    // True when nothing is left to spend and the record can be erased
+    bool IsPruned() const
+    {
+        BOOST_FOREACH(const CTxOut& txout, vout)
+            if (!txout.IsNull())
+                return false;
+        return true;
+    }
+};
+
+
+
+/** Undo information for one spent output.  When the spend emptied the
+ * coin record, the record's metadata is kept too so it can be recreated.
+ */
+class CTxInUndo
+{
+public:
+    CTxOut txout;
+    int nHeight;            // 0 if the coin record still existed after the spend
+    bool fCoinBase;
+    unsigned int nOutputs;
+
+    CTxInUndo() : nHeight(0), fCoinBase(false), nOutputs(0) { }
+    CTxInUndo(const CTxOut& txoutIn) : txout(txoutIn), nHeight(0), fCoinBase(false), nOutputs(0) { }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txout);
+        READWRITE(nHeight);
+        if (nHeight > 0)
+        {
+            READWRITE(fCoinBase);
+            READWRITE(nOutputs);
+        }
+    )
+};
+
+/** Undo information for the inputs of one transaction, in input order */
+class CTxUndo
+{
+public:
+    std::vector<CTxInUndo> vprevout;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vprevout);
+    )
+};
+
+/** Undo information for a block: one CTxUndo per transaction but the coinbase */
+class CBlockUndo
+{
+public:
+    std::vector<CTxUndo> vtxundo;
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(vtxundo);
+    )
+};
+
+
+
+/** Closure representing one script verification.
+ *  Note that this stores a pointer to the spending transaction, which must
+ *  outlive the check.
+ */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    bool fStrictPayToScriptHash;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), fStrictPayToScriptHash(false), nHashType(0) {}
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, bool fStrictPayToScriptHashIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), fStrictPayToScriptHash(fStrictPayToScriptHashIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(fStrictPayToScriptHash, check.fStrictPayToScriptHash);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
+
+
 
 
 /** A transaction with a merkle branch linking it to the block chain. */
@@ -784,25 +983,22 @@ public:
 
 
 
-/**  A txdb record that contains the disk location of a transaction and the
- * locations of transactions that spend its outputs.  vSpent is really only
- * used as a flag, but having the location is very helpful for debugging.
+/**  A txdb record that contains the disk location of a transaction.  Whether
+ * its outputs are spent is tracked by the coin database (see CCoins).
  */
 class CTxIndex
 {
 public:
     CDiskTxPos pos;
-    std::vector<CDiskTxPos> vSpent;
 
     CTxIndex()
     {
         SetNull();
     }
 
-    CTxIndex(const CDiskTxPos& posIn, unsigned int nOutputs)
+    CTxIndex(const CDiskTxPos& posIn)
     {
         pos = posIn;
-        vSpent.resize(nOutputs);
     }
 
     IMPLEMENT_SERIALIZE
@@ -810,13 +1006,15 @@ public:
         if (!(nType & SER_GETHASH))
             READWRITE(nVersion);
         READWRITE(pos);
+        // Spent pointers from before COINS_INDEX_VERSION; read and dropped,
+        // written empty
+        std::vector<CDiskTxPos> vSpent;
         READWRITE(vSpent);
     )
 
     void SetNull()
     {
         pos.SetNull();
-        vSpent.clear();
     }
 
     bool IsNull()
@@ -826,20 +1024,75 @@ public:
 
     friend bool operator==(const CTxIndex& a, const CTxIndex& b)
     {
-        return (a.pos    == b.pos &&
-                a.vSpent == b.vSpent);
+        return (a.pos == b.pos);
     }
 
     friend bool operator!=(const CTxIndex& a, const CTxIndex& b)
     {
         return !(a == b);
     }
+    int GetHeightInMainChain() const;
     int GetDepthInMainChain() const;
  
 };
 
 
 
+/** In-memory write-back cache over the coin database.  coinsTip, the one
+ * instance at the bottom, keeps the coin changes of connected blocks across
+ * many blocks until FlushCoinsCache() writes them out in one batch.  Views
+ * stacked on top (per block, per candidate transaction) hold their changes
+ * until Flush() hands them down, so a failure just drops the view.  Reads
+ * that miss coinsTip go to the txdb the outermost view was opened with.
+ * Everything here is protected by cs_main.
+ */
+class CCoinsCache
+{
+protected:
+    struct CEntry
+    {
+        CCoins coins;
+        bool fDirty;
+    };
+    typedef std::map<uint256, CEntry> entrymap_type;
+
+    CCoinsCache* pbase;
+    CTxDB* ptxdb;
+    entrymap_type cacheCoins;
+    uint256 hashBlock;
+    int64 nMemoryUsage;
+
+    entrymap_type::iterator FetchCoins(const uint256& txid, CTxDB& txdb);
+    void Store(const uint256& txid, const CCoins& coins, bool fDirty);
+
+public:
+    // coinsTip
+    CCoinsCache() : pbase(NULL), ptxdb(NULL), hashBlock(0), nMemoryUsage(0) { }
+    // view on coinsTip, reading through txdb
+    CCoinsCache(CTxDB& txdbIn);
+    // view on another view
+    CCoinsCache(CCoinsCache& baseIn) : pbase(&baseIn), ptxdb(baseIn.ptxdb), hashBlock(0), nMemoryUsage(0) { }
+
+    // Unspent outputs of txid; false if there are none
+    bool GetCoins(const uint256& txid, CCoins& coins);
+    // Record new coins for txid; pruned coins erase the record
+    void SetCoins(const uint256& txid, const CCoins& coins);
+    bool HaveCoins(const uint256& txid);
+    // Hand changes down to the base (views only)
+    bool Flush();
+    // Write changes to disk, tagged with the best block (coinsTip only)
+    bool WriteToDisk(CTxDB& txdb, bool fClear);
+
+    void SetBestBlock(const uint256& hashBlockIn) { hashBlock = hashBlockIn; }
+    uint256 GetBestBlock() const { return hashBlock; }
+    unsigned int GetCacheSize() const { return cacheCoins.size(); }
+    int64 GetMemoryUsage() const { return nMemoryUsage; }
+};
+
+extern CCoinsCache coinsTip;
+
+
+
 
 
 /** Nodes collect new transactions into a block, hash them into a hash tree,
@@ -869,6 +1122,7 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    mutable uint256 hashPoWChecked; // scrypt hash, set once CheckBlock passed its proof of work
 
     // Denial-of-service detection:
     mutable int nDoS;
@@ -906,6 +1160,7 @@ public:
         nNonce = 0;
         vtx.clear();
         vMerkleTree.clear();
+        hashPoWChecked = 0;
         nDoS = 0;
     }
 
@@ -922,7 +1177,8 @@ public:
     uint256 GetPoWHash() const
     {
         uint256 thash;
-        scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
+        if (!GetPrecomputedPoWHash(GetHash(), thash))
+            scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
         return thash;
     }
 
@@ -1064,12 +1320,12 @@ public:
     }
 
 
-    bool DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex);
-    bool ConnectBlock(CTxDB& txdb, CBlockIndex* pindex);
+    bool DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex, CCoinsCache& view);
+    bool ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, CCoinsCache& view);
     bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos);
-    bool CheckBlock() const;
+    bool CheckBlock(const CBlockIndex* pindex=NULL) const;
     bool AcceptBlock();
 
 private:
@@ -1091,31 +1347,49 @@ private:
 class CBlockIndex
 {
 public:
+    // Pointers, then 256-bit values, then 32-bit ones, so that nothing is
+    // padded; there is one of these per block in memory
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
-    unsigned int nFile;
-    unsigned int nBlockPos;
-    int nHeight;
-    CBigNum bnChainWork;
+    // memory only: an ancestor further back, for GetAncestor
+    CBlockIndex* pskip;
+
+    // total work of the chain up to and including this block
+    uint256 nChainWork;
+
+    // scrypt hash of the header once its proof of work has been checked,
+    // 0 for entries written by older clients that haven't been re-checked
+    uint256 hashPoW;
 
     // block header
-    int nVersion;
     uint256 hashMerkleRoot;
+    int nVersion;
     unsigned int nTime;
     unsigned int nBits;
     unsigned int nNonce;
 
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    int nHeight;
+
+    // memory only: Kimoto Gravity Well target of the next block, 0 until
+    // first asked for; guarded by cs_nBitsNextKGW in main.cpp
+    mutable unsigned int nBitsNextKGW;
+
 
     CBlockIndex()
     {
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
-        bnChainWork = 0;
+        nChainWork = 0;
+        hashPoW = 0;
+        nBitsNextKGW = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1129,10 +1403,13 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
-        bnChainWork = 0;
+        nChainWork = 0;
+        hashPoW = block.hashPoWChecked;
+        nBitsNextKGW = 0;
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
@@ -1164,13 +1441,15 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        bool fNegative, fOverflow;
+        uint256 bnTarget;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // 2**256 / (bnTarget+1) doesn't fit, but equals this
+        return (~bnTarget / (bnTarget + 1)) + 1;
     }
 
     bool IsInMainChain() const
@@ -1178,6 +1457,13 @@ public:
         return (pnext || this == pindexBest);
     }
 
+    // Set pskip once pprev and nHeight are known; the ancestors' must be set
+    void BuildSkip();
+
+    // The ancestor of this block at nHeightIn, NULL if out of range
+    CBlockIndex* GetAncestor(int nHeightIn);
+    const CBlockIndex* GetAncestor(int nHeightIn) const;
+
     bool CheckIndex() const
     {
         return true; // CheckProofOfWork(GetBlockHash(), nBits);
@@ -1265,6 +1551,10 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
+
+        // nVersion here is the client version the entry was written with
+        if (nVersion >= POWHASH_INDEX_VERSION)
+            READWRITE(hashPoW);
     )
 
     uint256 GetBlockHash() const
@@ -1325,7 +1615,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1361,8 +1651,7 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            pindex = pindex->GetAncestor(pindex->nHeight - nStep);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1376,7 +1665,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1395,7 +1684,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1411,7 +1700,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1644,18 +1933,104 @@ public:
     static CAlert getAlertByHash(const uint256 &hash);
 };
 
+/** What block creation needs to know about a memory pool transaction,
+ * worked out once when it enters the pool */
+class CTxMemPoolEntry
+{
+public:
+    int64 nFee;              // fee paid, -1 if its inputs couldn't be found
+    unsigned int nTxSize;
+    double dPriority;        // priority at nHeight, from inputs already in the chain
+    int64 nValueInChain;     // value of those inputs, which is what ages
+    int nHeight;             // best height when it entered
+    size_t nUsage;           // memory it holds in the pool, roughly
+    bool fScriptsChecked;    // signatures verified, on entry or since
+    std::set<uint256> setDepends; // transactions in the pool it spends
+    std::set<uint256> setSpentBy; // transactions in the pool that spend it
+
+    CTxMemPoolEntry()
+    {
+        nFee = -1;
+        nTxSize = 0;
+        dPriority = 0;
+        nValueInChain = 0;
+        nHeight = 0;
+        nUsage = 0;
+        fScriptsChecked = false;
+    }
+
+    // Priority is sum(valuein * age) / txsize, so it only grows by the
+    // chain inputs' value each block
+    double GetPriority(int nCurrentHeight) const
+    {
+        return dPriority + (double)nValueInChain * (nCurrentHeight - nHeight) / nTxSize;
+    }
+
+    // Fee per 1000 bytes, for ordering
+    double GetFeeRate() const
+    {
+        return nFee > 0 ? (double)nFee * 1000 / nTxSize : 0;
+    }
+};
+
+/** Position of a memory pool transaction in the order block creation
+ * considers them: fee rate, then priority when it entered */
+class CTxMemPoolRank
+{
+public:
+    double dFeeRate;
+    double dPriority;
+    uint256 hash;
+
+    CTxMemPoolRank(const uint256& hashIn, const CTxMemPoolEntry& entry)
+    {
+        dFeeRate = entry.GetFeeRate();
+        dPriority = entry.dPriority;
+        hash = hashIn;
+    }
+
+    // Best first
+    friend bool operator<(const CTxMemPoolRank& a, const CTxMemPoolRank& b)
+    {
+        if (a.dFeeRate != b.dFeeRate)
+            return a.dFeeRate > b.dFeeRate;
+        if (a.dPriority != b.dPriority)
+            return a.dPriority > b.dPriority;
+        return a.hash < b.hash;
+    }
+};
+
 class CTxMemPool
 {
 public:
+    typedef boost::unordered_map<uint256, CTransaction, CSaltedHasher> txmap_type;
+    typedef boost::unordered_map<COutPoint, CInPoint, COutPointHasher> nexttxmap_type;
+    typedef boost::unordered_map<uint256, CTxMemPoolEntry, CSaltedHasher> entrymap_type;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
-    std::map<COutPoint, CInPoint> mapNextTx;
+    txmap_type mapTx;
+    nexttxmap_type mapNextTx;
+    entrymap_type mapEntry;                      // kept in step with mapTx
+    std::set<CTxMemPoolRank> setRank;            // every transaction, best first
+    size_t nUsage;                               // memory held by all entries
+    double dMinFeeRate;  // fee per 1000 bytes to get in since it was last full
+    int64 nMinFeeRateTime;
+
+    CTxMemPool()
+    {
+        nUsage = 0;
+        dMinFeeRate = 0;
+        nMinFeeRateTime = 0;
+    }
 
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool fCheckInputs, bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entry);
     bool remove(CTransaction &tx);
+    void removeForBlock(std::vector<CTransaction>& vtx, int nBlockHeight);
     void queryHashes(std::vector<uint256>& vtxid);
+    int64 GetMinFee(unsigned int nBytes);
+    void LimitSize(size_t nMaxUsage);
 
     unsigned long size()
     {
@@ -15,6 +15,17 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#endif
+
+// Socket readiness comes from edge-triggered epoll on Linux, poll() on
+// other unix systems and select() on Windows
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -28,6 +39,7 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 16;
+static const int MAX_MESSAGE_THREADS = 16;
 
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
@@ -38,6 +50,8 @@ void ThreadMapPort2(void* parg);
 #endif
 void ThreadDNSAddressSeed2(void* parg);
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+static void RegisterSocket(CNode* pnode);
+static void UnregisterSocket(SOCKET hSocket);
 
 
 struct LocalServiceInfo {
@@ -69,6 +83,25 @@ deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64> mapAlreadyAskedFor;
 
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+#endif
+#ifndef WIN32
+// Written to by WakeSocketHandler() to cut the socket thread's wait short
+static int hWakePipe[2] = { -1, -1 };
+#endif
+static bool fAcceptReady = false;
+
+// The message handler waits on this between passes
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable condMessageHandler;
+static bool fMessageHandlerWake = false;
+
+// Time and best height of the last SendMessages pass over all peers
+static CCriticalSection cs_nLastSendAll;
+static int64 nLastSendAll = 0;
+static int nLastSendAllHeight = -1;
+
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
 
@@ -99,6 +132,17 @@ void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
     PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+void CNode::PushGetHeaders(CBlockIndex* pindexBegin, uint256 hashEnd)
+{
+    // Filter out duplicate requests
+    if (pindexBegin == pindexLastGetHeadersBegin && hashEnd == hashLastGetHeadersEnd)
+        return;
+    pindexLastGetHeadersBegin = pindexBegin;
+    hashLastGetHeadersEnd = hashEnd;
+
+    PushMessage("getheaders", CBlockLocator(pindexBegin), hashEnd);
+}
+
 // find 'best' local address for a particular peer
 bool GetLocal(CService& addr, const CNetAddr *paddrPeer)
 {
@@ -511,6 +555,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
 
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+        RegisterSocket(pnode);
         if (nTimeout != 0)
             pnode->AddRef(nTimeout);
         else
@@ -536,12 +581,35 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         printf("disconnecting node %s\n", addrName.c_str());
+        UnregisterSocket(hSocket);
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
+        nRecvHeaderPos = 0;
+        vRecvPartial.clear();
+        {
+            LOCK(cs_vRecvMsg);
+            vRecvMsg.clear();
+            nRecvMsgBytes = 0;
+        }
     }
 }
 
+// While a payload is arriving, the space its remaining bytes will go in, so
+// the socket can be read straight into the message.  NULL between payloads.
+// Called with cs_vRecv held.
+char* CNode::GetRecvWindow(unsigned int& nWindow)
+{
+    if (vRecvPartial.empty())
+        return NULL;
+    CNetMessage& msg = vRecvPartial.front();
+
+    // Grow the buffer as data arrives rather than trusting the header's size
+    nWindow = min(msg.nMessageSize - msg.nDataPos, (unsigned int)0x10000);
+    if (msg.vRecv.size() < msg.nDataPos + nWindow)
+        msg.vRecv.resize(msg.nDataPos + nWindow);
+    return &msg.vRecv[msg.nDataPos];
+}
+
 void CNode::Cleanup()
 {
 }
@@ -638,6 +706,311 @@ void CNode::copyStats(CNodeStats &stats)
 
 
 
+static void InitSocketReactor()
+{
+#ifndef WIN32
+    if (hWakePipe[0] == -1)
+    {
+        if (pipe(hWakePipe) == 0)
+        {
+            // Not inherited by -blocknotify and friends
+            for (int i = 0; i < 2; i++)
+            {
+                fcntl(hWakePipe[i], F_SETFL, O_NONBLOCK);
+                fcntl(hWakePipe[i], F_SETFD, FD_CLOEXEC);
+            }
+        }
+        else
+        {
+            printf("InitSocketReactor() : pipe failed, error %d\n", errno);
+            hWakePipe[0] = hWakePipe[1] = -1;
+        }
+    }
+#endif
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+        return;
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+    {
+        // poll() does the job too, only slower with many peers
+        printf("InitSocketReactor() : epoll_create1 failed, error %d, using poll\n", errno);
+        return;
+    }
+    // data.ptr is the CNode, NULL for the listening sockets and the wake
+    // pipe for itself
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == -1)
+            printf("InitSocketReactor() : epoll_ctl failed for listening socket, error %d\n", errno);
+    fAcceptReady = true;
+    if (hWakePipe[0] != -1)
+    {
+        event.data.ptr = hWakePipe;
+        epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWakePipe[0], &event);
+    }
+#endif
+}
+
+// Add a node's socket to the epoll set
+static void RegisterSocket(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1)
+    {
+        printf("RegisterSocket() : epoll_ctl failed, error %d\n", errno);
+        pnode->fDisconnect = true;
+    }
+#endif
+}
+
+// Take a socket out of the epoll set before it is closed.  Closing alone
+// isn't enough if a child process (-blocknotify) inherited it.
+static void UnregisterSocket(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+        return;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &event);
+#endif
+}
+
+void WakeSocketHandler()
+{
+#ifndef WIN32
+    if (hWakePipe[1] == -1)
+        return;
+    // The pipe is non-blocking; once it is full a wake is pending anyway
+    char c = 0;
+    if (write(hWakePipe[1], &c, 1) != 1 && errno != EAGAIN && errno != EWOULDBLOCK)
+        printf("WakeSocketHandler() : write failed, error %d\n", errno);
+#endif
+}
+
+#ifndef WIN32
+// Anything written while this runs is either read here, and the loop pass
+// that follows sees it, or left in the pipe to end the next wait
+static void DrainWakePipe()
+{
+    char pchBuf[64];
+    while (read(hWakePipe[0], pchBuf, sizeof(pchBuf)) > 0)
+        ;
+}
+#endif
+
+// Wait up to nTimeout milliseconds for sockets to become ready, and mark
+// them in fSocketReadable/fSocketWritable and fAcceptReady.  With epoll the
+// marks stay until a recv or send would block; the others poll for them
+// again each time.
+static void WaitForSockets(const vector<CNode*>& vNodesCopy, int nTimeout)
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+    {
+        struct epoll_event events[256];
+        int nEvents = epoll_wait(hEpoll, events, 256, nTimeout);
+        if (nEvents == -1 && errno != EINTR)
+        {
+            printf("socket epoll_wait error %d\n", errno);
+            Sleep(nTimeout);
+        }
+        for (int i = 0; i < nEvents; i++)
+        {
+            void* ptr = events[i].data.ptr;
+            if (ptr == NULL)
+                fAcceptReady = true;
+            else if (ptr == hWakePipe)
+                DrainWakePipe();
+            else
+            {
+                CNode* pnode = (CNode*)ptr;
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    pnode->fSocketReadable = true;
+                if (events[i].events & EPOLLOUT)
+                    pnode->fSocketWritable = true;
+            }
+        }
+        return;
+    }
+#endif
+
+#ifndef WIN32
+    vector<struct pollfd> vpollfd;
+    vpollfd.reserve(vhListenSocket.size() + vNodesCopy.size() + 1);
+    struct pollfd pfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+    {
+        pfd.fd = hListenSocket;
+        vpollfd.push_back(pfd);
+    }
+    pfd.fd = hWakePipe[0];
+    vpollfd.push_back(pfd);
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        pfd.fd = pnode->hSocket;
+        pfd.events = POLLIN;
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend && !pnode->vSendMsg.empty())
+                pfd.events |= POLLOUT;
+        }
+        vpollfd.push_back(pfd);
+    }
+
+    int nPoll = poll(&vpollfd[0], vpollfd.size(), nTimeout);
+    if (nPoll == SOCKET_ERROR && errno != EINTR)
+    {
+        printf("socket poll error %d\n", errno);
+        Sleep(nTimeout);
+    }
+    if (nPoll <= 0)
+    {
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->fSocketReadable = pnode->fSocketWritable = false;
+        return;
+    }
+    unsigned int n = 0;
+    for (; n < vhListenSocket.size(); n++)
+        if (vpollfd[n].revents & POLLIN)
+            fAcceptReady = true;
+    if (vpollfd[n++].revents & POLLIN)
+        DrainWakePipe();
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        short revents = vpollfd[n++].revents;
+        pnode->fSocketReadable = (revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+        pnode->fSocketWritable = (revents & POLLOUT) != 0;
+    }
+#else
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = nTimeout * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket);
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        FD_SET(pnode->hSocket, &fdsetRecv);
+        FD_SET(pnode->hSocket, &fdsetError);
+        hSocketMax = max(hSocketMax, pnode->hSocket);
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend && !pnode->vSendMsg.empty())
+                FD_SET(pnode->hSocket, &fdsetSend);
+        }
+    }
+
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        if (hSocketMax != INVALID_SOCKET)
+        {
+            printf("socket select error %d\n", nErr);
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        Sleep(nTimeout);
+    }
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (FD_ISSET(hListenSocket, &fdsetRecv))
+            fAcceptReady = true;
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        pnode->fSocketReadable = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+        pnode->fSocketWritable = FD_ISSET(pnode->hSocket, &fdsetSend);
+    }
+#endif
+}
+
+// Accept one pending connection on hListenSocket.  Returns false once there
+// are no more.
+static bool AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            printf("warning: unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        if (WSAGetLastError() != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", WSAGetLastError());
+        return false;
+    }
+    else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        RegisterSocket(pnode);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+    return true;
+}
+
 void ThreadSocketHandler(void* parg)
 {
     IMPLEMENT_RANDOMIZE_STACK(ThreadSocketHandler(parg));
@@ -661,11 +1034,87 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exited\n");
 }
 
+// Write as much of pnode's send queue as the socket will take, gathering
+// several queued buffers into each call.  Called with cs_vSend held.
+static void SocketSendData(CNode* pnode)
+{
+    while (!pnode->vSendMsg.empty())
+    {
+#ifdef WIN32
+        const CSerializeData& data = *pnode->vSendMsg.front();
+        size_t nWant = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nWant, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[64];
+        int nIov = 0;
+        size_t nWant = 0;
+        for (deque<CSendBuffer>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < 64; ++it, ++nIov)
+        {
+            size_t nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+            iov[nIov].iov_base = (void*)&(**it)[nOffset];
+            iov[nIov].iov_len = (*it)->size() - nOffset;
+            nWant += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (nBytes > 0)
+        {
+            pnode->nLastSend = GetTime();
+            pnode->nSendSize -= nBytes;
+
+            // Drop the buffers that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0)
+            {
+                size_t nFront = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+                if (nLeft < nFront)
+                {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nFront;
+                pnode->nSendOffset = 0;
+                pnode->vSendMsg.pop_front();
+            }
+
+            // A short write filled the socket buffer
+            if ((size_t)nBytes < nWant)
+            {
+                pnode->fSocketWritable = false;
+                break;
+            }
+        }
+        else
+        {
+            if (nBytes < 0)
+            {
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr == WSAEWOULDBLOCK)
+                    pnode->fSocketWritable = false;
+                else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                {
+                    printf("socket send error %d\n", nErr);
+                    pnode->CloseSocketDisconnect();
+                }
+            }
+            break;
+        }
+    }
+}
+
 void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
+    bool fMoreWork = false; // a socket has data left to read or accept
+    bool fBlocked = false;  // a socket was skipped because its buffer was locked
+    int64 nLastInactivityCheck = 0;
 
     loop
     {
@@ -679,7 +1128,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->nRecvMsgBytes == 0 && pnode->vRecvPartial.empty() && pnode->vSendMsg.empty()))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -740,129 +1189,48 @@ void ThreadSocketHandler2(void* parg)
 
 
         //
-        // Find which sockets have data to receive
+        // Wait for sockets to become ready.  Don't wait if some socket still
+        // has data we didn't get to last time.
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-        }
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                }
-            }
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
 
         vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        WaitForSockets(vNodesCopy, fMoreWork ? 0 : fBlocked ? 10 : 50);
         vnThreadsRunning[THREAD_SOCKETHANDLER]++;
         if (fShutdown)
             return;
-        if (nSelect == SOCKET_ERROR)
-        {
-            int nErr = WSAGetLastError();
-            if (hSocketMax != INVALID_SOCKET)
-            {
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            Sleep(timeout.tv_usec/1000);
-        }
+        fMoreWork = false;
+        fBlocked = false;
+        bool fNewMessages = false;
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (fAcceptReady)
         {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("warning: unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                if (WSAGetLastError() != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", WSAGetLastError());
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
+            // Bounded so a connection flood can't starve the peers we have
+            int nAccepted = 0;
+            fAcceptReady = false;
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                while (hListenSocket != INVALID_SOCKET && AcceptConnection(hListenSocket))
+                    if (++nAccepted >= 64)
+                    {
+                        fAcceptReady = fMoreWork = true;
+                        break;
+                    }
         }
 
 
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             if (fShutdown)
@@ -873,47 +1241,61 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fSocketReadable && pnode->nRecvMsgBytes > ReceiveBufferSize())
+            {
+                // Leave the data in the socket until the message handler
+                // catches up
+                fBlocked = true;
+            }
+            else if (pnode->fSocketReadable)
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
+                if (!lockRecv)
+                    fBlocked = true;
+                else
                 {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
+                    // Mid-payload, read straight into the message; otherwise
+                    // into a scratch buffer for the framer to split up.
+                    // Typical socket buffer is 8K-64K
+                    char pchBuf[0x10000];
+                    unsigned int nWindow = sizeof(pchBuf);
+                    char* pchWindow = pnode->GetRecvWindow(nWindow);
+                    int nBytes = recv(pnode->hSocket, pchWindow ? pchWindow : pchBuf, nWindow, MSG_DONTWAIT);
+                    if (nBytes > 0)
+                    {
+                        pnode->nLastRecv = GetTime();
+                        bool fQueued = false;
+                        if (!FrameMessages(pnode, pchWindow ? NULL : pchBuf, nBytes, fQueued))
+                            pnode->CloseSocketDisconnect();
+                        if (fQueued)
+                            fNewMessages = true;
+
+                        // A short read emptied the socket; a full one
+                        // may have left more behind
+                        if (nBytes < (int)nWindow)
+                            pnode->fSocketReadable = false;
+                        else
+                            fMoreWork = true;
+                    }
+                    else if (nBytes == 0)
+                    {
+                        // socket closed gracefully
                         if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%d bytes)\n", vRecv.size());
+                            printf("socket closed\n");
                         pnode->CloseSocketDisconnect();
                     }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
-                            pnode->nLastRecv = GetTime();
-                        }
-                        else if (nBytes == 0)
+                    else if (nBytes < 0)
+                    {
+                        // error
+                        int nErr = WSAGetLastError();
+                        if (nErr == WSAEWOULDBLOCK)
+                            pnode->fSocketReadable = false;
+                        else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                         {
-                            // socket closed gracefully
                             if (!pnode->fDisconnect)
-                                printf("socket closed\n");
+                                printf("socket recv error %d\n", nErr);
                             pnode->CloseSocketDisconnect();
                         }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
                     }
                 }
             }
@@ -923,41 +1305,28 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSocketWritable && !pnode->vSendMsg.empty())
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                if (!lockSend)
+                    fBlocked = true;
+                else
+                    SocketSendData(pnode);
             }
-
-            //
-            // Inactivity checking
-            //
-            if (pnode->vSend.empty())
+            if (pnode->vSendMsg.empty())
                 pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
+        }
+
+        //
+        // Inactivity checking, once a second is plenty
+        //
+        if (GetTime() != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = GetTime();
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
+                if (pnode->hSocket == INVALID_SOCKET || GetTime() - pnode->nTimeConnected <= 60)
+                    continue;
                 if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
                 {
                     printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
@@ -980,8 +1349,8 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
-
-        Sleep(10);
+        if (fNewMessages)
+            WakeMessageHandler();
     }
 }
 
@@ -1569,6 +1938,18 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+void WakeMessageHandler()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+        fMessageHandlerWake = true;
+    }
+    condMessageHandler.notify_all();
+}
+
+// Several of these run at once.  Each peer is worked on by one of them at a
+// time, which keeps its messages in order; ProcessMessages leaves cs_main to
+// the messages that need it.
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
@@ -1583,29 +1964,55 @@ void ThreadMessageHandler2(void* parg)
                 pnode->AddRef();
         }
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        // Process the messages the socket thread has framed, and send the
+        // replies right away
+        bool fProcessed = false;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            // Receive messages
+            if (pnode->nRecvMsgBytes == 0)
+                continue;
+            TRY_LOCK(pnode->cs_processMsg, lockProcess);
+            if (!lockProcess)
+                continue;
+            if (ProcessMessages(pnode))
             {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                    ProcessMessages(pnode);
+                fProcessed = true;
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                    SendMessages(pnode, false);
             }
             if (fShutdown)
                 return;
+        }
 
-            // Send messages
+        // Every peer gets a SendMessages turn every 100ms for trickled
+        // inventory and timers, and as soon as there is a new best block to
+        // relay.  Whichever thread gets here first does it.
+        bool fSendAll = false;
+        {
+            TRY_LOCK(cs_nLastSendAll, lockSendAll);
+            if (lockSendAll && (GetTimeMillis() - nLastSendAll >= 100 || nBestHeight != nLastSendAllHeight))
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                nLastSendAll = GetTimeMillis();
+                nLastSendAllHeight = nBestHeight;
+                fSendAll = true;
+            }
+        }
+        if (fSendAll)
+        {
+            CNode* pnodeTrickle = NULL;
+            if (!vNodesCopy.empty())
+                pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            {
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
+                        SendMessages(pnode, pnode == pnodeTrickle);
+                }
+                if (fShutdown)
+                    return;
             }
-            if (fShutdown)
-                return;
         }
 
         {
@@ -1614,11 +2021,18 @@ void ThreadMessageHandler2(void* parg)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
-        // Reduce vnThreadsRunning so StopNode has permission to exit while
-        // we're sleeping, but we must always check fShutdown after doing this.
+        // Wait for the socket thread to frame new messages, or for the next
+        // 100ms tick.  Reduce vnThreadsRunning so StopNode has permission to
+        // exit while we're waiting, but we must always check fShutdown after
+        // doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        Sleep(100);
+        if (!fProcessed)
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            if (!fMessageHandlerWake)
+                condMessageHandler.timed_wait(lock, boost::posix_time::milliseconds(100));
+            fMessageHandlerWake = false;
+        }
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1807,6 +2221,20 @@ void StartNode(void* parg)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+#ifndef WIN32
+    // Every connection needs a file descriptor, on top of the ones for the
+    // databases and block files
+    struct rlimit limitFD;
+    rlim_t nWantFD = GetArg("-maxconnections", 125) + 128;
+    if (getrlimit(RLIMIT_NOFILE, &limitFD) != -1 && limitFD.rlim_cur < nWantFD)
+    {
+        limitFD.rlim_cur = min(nWantFD, limitFD.rlim_max);
+        if (setrlimit(RLIMIT_NOFILE, &limitFD) == -1 || limitFD.rlim_cur < nWantFD)
+            printf("Warning: open file limit %d is too low for -maxconnections\n", (int)limitFD.rlim_cur);
+    }
+#endif
+    InitSocketReactor();
+
     Discover();
 
     //
@@ -1840,8 +2268,10 @@ void StartNode(void* parg)
         printf("Error: CreateThread(ThreadOpenConnections) failed\n");
 
     // Process messages
-    if (!CreateThread(ThreadMessageHandler, NULL))
-        printf("Error: CreateThread(ThreadMessageHandler) failed\n");
+    int nMessageThreads = min(max((int)GetArg("-msgthreads", 2), 1), MAX_MESSAGE_THREADS);
+    for (int i = 0; i < nMessageThreads; i++)
+        if (!CreateThread(ThreadMessageHandler, NULL))
+            printf("Error: CreateThread(ThreadMessageHandler) failed\n");
 
     // Dump network addresses
     if (!CreateThread(ThreadDumpAddress, NULL))
@@ -1856,6 +2286,7 @@ bool StopNode()
     printf("StopNode()\n");
     fShutdown = true;
     nTransactionsUpdated++;
+    WakeMessageHandler();
     int64 nStart = GetTime();
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
@@ -1883,7 +2314,13 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_DNSSEED] > 0) printf("ThreadDNSAddressSeed still running\n");
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    if (vnThreadsRunning[THREAD_POWCHECK] > 0) printf("ThreadPoWCheck still running\n");
+    if (vnThreadsRunning[THREAD_SCRIPTCHECK] > 0) printf("ThreadScriptCheck still running\n");
+    if (vnThreadsRunning[THREAD_VERIFY] > 0) printf("ThreadVerifyBlocks still running\n");
+    // Block verification reads the coin cache and the chain database, which
+    // Shutdown() flushes and closes next
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 ||
+           vnThreadsRunning[THREAD_VERIFY] > 0)
         Sleep(20);
     Sleep(50);
     DumpAddresses();
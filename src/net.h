@@ -9,8 +9,10 @@
 #define BITCOIN_NET_H
 
 #include <deque>
+#include <list>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -44,6 +46,10 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+// Get the socket thread to send newly queued data right away
+void WakeSocketHandler();
+// Get the message handler to look at the peers again right away
+void WakeMessageHandler();
 
 enum
 {
@@ -96,6 +102,73 @@ public:
 };
 
 
+/** A serialized message, header included, waiting in one or more peers'
+ * send queues.  Shared so a block serialized once can go to every peer. */
+typedef boost::shared_ptr<const CSerializeData> CSendBuffer;
+
+// Fill in the size and checksum of the message header at nHeaderStart for
+// the payload from nMessageStart to the end of the stream
+inline void SetMessageSizeAndChecksum(CDataStream& ss, unsigned int nHeaderStart, unsigned int nMessageStart)
+{
+    unsigned int nSize = ss.size() - nMessageStart;
+    memcpy((char*)&ss[nHeaderStart] + CMessageHeader::MESSAGE_SIZE_OFFSET, &nSize, sizeof(nSize));
+
+    uint256 hash = Hash(ss.begin() + nMessageStart, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(nMessageStart - nHeaderStart >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[nHeaderStart] + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
+}
+
+// Take a message built in ss, header at the start and payload from
+// nMessageStart, as a buffer for CNode::PushSharedMessage
+inline CSendBuffer FinishSharedMessage(CDataStream& ss, unsigned int nMessageStart)
+{
+    SetMessageSizeAndChecksum(ss, 0, nMessageStart);
+    CSerializeData* pdata = new CSerializeData();
+    ss.GetAndClear(*pdata);
+    return CSendBuffer(pdata);
+}
+
+// Serialize a message once for CNode::PushSharedMessage.  Only for payloads
+// whose encoding doesn't depend on the peer's protocol version.
+template<typename T>
+CSendBuffer SerializeMessage(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0, true, nBestHeight);
+    unsigned int nMessageStart = ss.size();
+    ss << payload;
+    return FinishSharedMessage(ss, nMessageStart);
+}
+
+/** A message from a peer.  The socket thread receives the payload straight
+ * into vRecv; once complete and checksum checked it waits to be processed. */
+class CNetMessage
+{
+public:
+    std::string strCommand;
+    CDataStream vRecv; // payload
+    unsigned int nMessageSize; // payload size from the header
+    unsigned int nChecksum;    // checksum from the header
+    unsigned int nDataPos;     // payload bytes received so far
+    bool fPoWScanned;          // header already handed to the PoW threads
+
+    CNetMessage(const std::string& strCommandIn, int nTypeIn, int nVersionIn) : strCommand(strCommandIn), vRecv(nTypeIn, nVersionIn)
+    {
+        nMessageSize = 0;
+        nChecksum = 0;
+        nDataPos = 0;
+        fPoWScanned = false;
+    }
+
+    bool IsComplete() const
+    {
+        return nDataPos == nMessageSize;
+    }
+};
+
+
 /** Thread types */
 enum threadId
 {
@@ -109,6 +182,9 @@ enum threadId
     THREAD_ADDEDCONNECTIONS,
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
+    THREAD_POWCHECK,
+    THREAD_SCRIPTCHECK,
+    THREAD_VERIFY,
 
     THREAD_MAX
 };
@@ -158,10 +234,20 @@ public:
     // socket
     uint64 nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    CDataStream vSend;                // message being built by BeginMessage/EndMessage
+    std::deque<CSendBuffer> vSendMsg; // complete messages waiting for the socket
+    size_t nSendOffset;               // bytes of vSendMsg.front() already sent
+    size_t nSendSize;                 // bytes queued in vSendMsg
     CCriticalSection cs_vSend;
-    CCriticalSection cs_vRecv;
+    CCriticalSection cs_vRecv;       // held by the socket thread while framing
+    char pchRecvHeader[CMessageHeader::HEADER_SIZE]; // header being assembled
+    unsigned int nRecvHeaderPos;
+    std::list<CNetMessage> vRecvPartial; // message whose payload is arriving, at most one
+    int nRecvVersion;
+    std::list<CNetMessage> vRecvMsg; // framed by the socket thread
+    unsigned int nRecvMsgBytes;      // bytes in vRecvMsg, headers included
+    CCriticalSection cs_vRecvMsg;
+    CCriticalSection cs_processMsg;  // held by the handler thread working on this peer
     int64 nLastSend;
     int64 nLastRecv;
     int64 nLastSendEmpty;
@@ -179,6 +265,8 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    bool fSocketReadable; // socket thread only: recv won't block
+    bool fSocketWritable; // socket thread only: send won't block
     CSemaphoreGrant grantOutbound;
 protected:
     int nRefCount;
@@ -196,11 +284,18 @@ public:
     uint256 hashContinue;
     CBlockIndex* pindexLastGetBlocksBegin;
     uint256 hashLastGetBlocksEnd;
+    CBlockIndex* pindexLastGetHeadersBegin;
+    uint256 hashLastGetHeadersEnd;
     int nStartingHeight;
 
+    // headers-first sync, protected by cs_main
+    int nSyncHeight; // height of the best block the peer is known to have
+    std::map<uint256, int64> mapBlocksInFlight; // block hash -> time requested
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -210,7 +305,7 @@ public:
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -220,6 +315,8 @@ public:
         nTimeConnected = GetTime();
         nHeaderStart = -1;
         nMessageStart = -1;
+        nSendOffset = 0;
+        nSendSize = 0;
         addr = addrIn;
         addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
         nVersion = 0;
@@ -230,12 +327,20 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fSocketReadable = false;
+        fSocketWritable = true;
+        nRecvHeaderPos = 0;
+        nRecvVersion = MIN_PROTO_VERSION;
+        nRecvMsgBytes = 0;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
+        pindexLastGetHeadersBegin = 0;
+        hashLastGetHeadersEnd = 0;
         nStartingHeight = -1;
+        nSyncHeight = -1;
         fGetAddr = false;
         nMisbehavior = 0;
         setInventoryKnown.max_size(SendBufferSize() / 1000);
@@ -283,6 +388,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -291,6 +397,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -376,24 +483,35 @@ public:
         if (nHeaderStart < 0)
             return;
 
-        // Set the size
         unsigned int nSize = vSend.size() - nMessageStart;
-        memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::MESSAGE_SIZE_OFFSET, &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(vSend.begin() + nMessageStart, vSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(nMessageStart - nHeaderStart >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
+        SetMessageSizeAndChecksum(vSend, nHeaderStart, nMessageStart);
 
         if (fDebug) {
             printf("(%d bytes)\n", nSize);
         }
 
+        // Hand the finished message to the send queue
+        CSerializeData* pdata = new CSerializeData();
+        vSend.GetAndClear(*pdata);
+        nSendSize += pdata->size();
+        vSendMsg.push_back(CSendBuffer(pdata));
+
         nHeaderStart = -1;
         nMessageStart = -1;
         LEAVE_CRITICAL_SECTION(cs_vSend);
+
+        WakeSocketHandler();
+    }
+
+    // Queue a message made by SerializeMessage
+    void PushSharedMessage(const CSendBuffer& msg)
+    {
+        {
+            LOCK(cs_vSend);
+            nSendSize += msg->size();
+            vSendMsg.push_back(msg);
+        }
+        WakeSocketHandler();
     }
 
     void EndMessageAbortIfEmpty()
@@ -618,10 +736,12 @@ public:
 
 
     void PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd);
+    void PushGetHeaders(CBlockIndex* pindexBegin, uint256 hashEnd);
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
     void CloseSocketDisconnect();
+    char* GetRecvWindow(unsigned int& nWindow);
     void Cleanup();
 
 
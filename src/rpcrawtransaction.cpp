@@ -93,7 +93,7 @@ TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
@@ -332,16 +332,16 @@ Value signrawtransaction(const Array& params, bool fHelp)
     {
         MapPrevTx mapPrevTx;
         CTxDB txdb("r");
-        map<uint256, CTxIndex> unused;
+        CCoinsCache view(txdb);
         bool fInvalid;
-        mergedTx.FetchInputs(txdb, unused, false, false, mapPrevTx, fInvalid);
+        mergedTx.FetchInputs(view, false, false, mapPrevTx, fInvalid);
 
         // Copy results into mapPrevOut:
         BOOST_FOREACH(const CTxIn& txin, mergedTx.vin)
         {
             const uint256& prevHash = txin.prevout.hash;
             if (mapPrevTx.count(prevHash))
-                mapPrevOut[txin.prevout] = mapPrevTx[prevHash].second.vout[txin.prevout.n].scriptPubKey;
+                mapPrevOut[txin.prevout] = mapPrevTx[prevHash].vout[txin.prevout.n].scriptPubKey;
         }
     }
 
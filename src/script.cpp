@@ -5,7 +5,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
+#include <boost/unordered_set.hpp>
 
 using namespace std;
 using namespace boost;
@@ -1107,65 +1107,187 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Entries are a salted SHA256 of (signature hash, signature, public key),
+// so a peer can neither predict where an entry lands nor craft collisions.
+// The table is split into shards with their own lock, so script checks
+// running on several threads rarely contend.
+
+struct CSigCacheEntryHasher
+{
+    // entries are already uniformly distributed, any 64 bits will do
+    size_t operator()(const uint256& entry) const { return (size_t)entry.Get64(0); }
+};
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    enum { NUM_SHARDS = 16 };
+
+    // Approximate heap cost of one entry: the key plus hash node and
+    // bucket bookkeeping
+    enum { ENTRY_BYTES = sizeof(uint256) + 4 * sizeof(void*) };
+
+    typedef boost::unordered_set<uint256, CSigCacheEntryHasher> entryset_type;
+
+    struct CShard
+    {
+        CCriticalSection cs;
+        entryset_type setValid;
+        uint64 nHits;
+        uint64 nMisses;
+        uint64 nEvictions;
+
+        CShard() : nHits(0), nMisses(0), nEvictions(0) {}
+    };
+
+    CShard shards[NUM_SHARDS];
+    uint256 nonce;
+    unsigned int nMaxShardEntries;
+
+    uint256 ComputeEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey) const
+    {
+        uint256 entry;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, (const unsigned char*)&nonce, sizeof(nonce));
+        SHA256_Update(&ctx, (const unsigned char*)&hash, sizeof(hash));
+        // Length-prefix both fields so no two (sig, pubkey) splits of the
+        // same bytes share an entry
+        unsigned int nSigSize = vchSig.size();
+        SHA256_Update(&ctx, (const unsigned char*)&nSigSize, sizeof(nSigSize));
+        if (!vchSig.empty())
+            SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+        unsigned int nPubKeySize = pubKey.size();
+        SHA256_Update(&ctx, (const unsigned char*)&nPubKeySize, sizeof(nPubKeySize));
+        if (!pubKey.empty())
+            SHA256_Update(&ctx, &pubKey[0], pubKey.size());
+        SHA256_Final((unsigned char*)&entry, &ctx);
+        return entry;
+    }
+
+    CShard& ShardFor(const uint256& entry)
+    {
+        // use different bits than the bucket hash
+        return shards[entry.Get64(3) % NUM_SHARDS];
+    }
 
 public:
+    CSignatureCache()
+    {
+        SetMaxSize(10);
+    }
+
+    void SetNonce(const uint256& nonceIn)
+    {
+        // Changing the salt orphans all existing entries
+        for (int i = 0; i < NUM_SHARDS; i++)
+        {
+            LOCK(shards[i].cs);
+            shards[i].setValid.clear();
+        }
+        nonce = nonceIn;
+    }
+
+    void SetMaxEntries(int64 nMaxEntries)
+    {
+        if (nMaxEntries < 0)
+            nMaxEntries = 0;
+        nMaxShardEntries = (unsigned int)std::min((int64)std::numeric_limits<unsigned int>::max(),
+                                                  (nMaxEntries + NUM_SHARDS - 1) / NUM_SHARDS);
+    }
+
+    void SetMaxSize(int64 nMaxMegabytes)
+    {
+        if (nMaxMegabytes < 0)
+            nMaxMegabytes = 0;
+        SetMaxEntries(std::min(nMaxMegabytes, (int64)1 << 40) * 1048576 / ENTRY_BYTES);
+    }
+
     bool
     Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
-        LOCK(cs_sigcache);
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        CShard& shard = ShardFor(entry);
+        LOCK(shard.cs);
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
+        if (shard.setValid.count(entry))
+        {
+            shard.nHits++;
             return true;
+        }
+        shard.nMisses++;
         return false;
     }
 
     void
     Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (nMaxShardEntries == 0) return;
 
-        LOCK(cs_sigcache);
+        uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+        CShard& shard = ShardFor(entry);
+        LOCK(shard.cs);
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
+        while (shard.setValid.size() >= nMaxShardEntries)
         {
             // Evict a random entry. Random because that helps
             // foil would-be DoS attackers who might try to pre-generate
             // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            // than our cache size. Entries are salted hashes, so the
+            // first one found from a random bucket is unpredictable.
+            size_t nBuckets = shard.setValid.bucket_count();
+            size_t nBucket = GetRand(nBuckets);
+            while (shard.setValid.bucket_size(nBucket) == 0)
+                nBucket = (nBucket + 1) % nBuckets;
+            shard.setValid.erase(*shard.setValid.begin(nBucket));
+            shard.nEvictions++;
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        shard.setValid.insert(entry);
+    }
+
+    void GetStats(CSignatureCacheStats& stats)
+    {
+        stats.nEntries = stats.nHits = stats.nMisses = stats.nEvictions = 0;
+        for (int i = 0; i < NUM_SHARDS; i++)
+        {
+            LOCK(shards[i].cs);
+            stats.nEntries += shards[i].setValid.size();
+            stats.nHits += shards[i].nHits;
+            stats.nMisses += shards[i].nMisses;
+            stats.nEvictions += shards[i].nEvictions;
+        }
+        stats.nShards = NUM_SHARDS;
+        stats.nBytes = stats.nEntries * ENTRY_BYTES;
+        stats.nMaxBytes = (uint64)nMaxShardEntries * NUM_SHARDS * ENTRY_BYTES;
     }
 };
 
+static CSignatureCache signatureCache;
+
+void InitSignatureCache()
+{
+    // DoS prevention: limit cache size (default 10MB, roughly 160,000
+    // entries). There are at most 20,000 signature operations per block,
+    // so this comfortably holds a few blocks worth plus the memory pool.
+    // -maxsigcachesize is the old limit in entries; it still works, but
+    // -maxsigcachemb takes precedence
+    if (mapArgs.count("-maxsigcachemb") || !mapArgs.count("-maxsigcachesize"))
+        signatureCache.SetMaxSize(GetArg("-maxsigcachemb", 10));
+    else
+        signatureCache.SetMaxEntries(GetArg("-maxsigcachesize", 50000));
+    signatureCache.SetNonce(GetRandHash());
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    signatureCache.GetStats(stats);
+}
+
 bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
-    static CSignatureCache signatureCache;
-
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -599,6 +599,22 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                   bool fValidatePayToScriptHash, int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
 
+/** Signature cache counters, as reported by getsigcacheinfo */
+struct CSignatureCacheStats
+{
+    uint64 nEntries;
+    uint64 nBytes;
+    uint64 nMaxBytes;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvictions;
+    int nShards;
+};
+
+/** Size and salt the signature cache from -maxsigcachemb; call once at startup */
+void InitSignatureCache();
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
@@ -298,3 +298,233 @@ void scrypt_1024_1_1_256(const char *input, char *output)
 	char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
 	scrypt_1024_1_1_256_sp(input, output, scratchpad);
 }
+
+
+/*
+ * Multi-lane kernels.
+ *
+ * The SIMD cores run the salsa20/8 mixing of several independent hashes at
+ * once, one hash per vector lane.  The state is kept lane-interleaved: word k
+ * of every lane lives in X[k], and the scratchpad V holds 1024 such 32-vector
+ * rows.  PBKDF2 stays scalar; it is a small fraction of the work.
+ *
+ * The kernels are built with per-function target attributes so scrypt.c can
+ * still be compiled without any -m flags, and are only called after CPUID
+ * says the instructions are available.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SCRYPT_MULTI_X86 1
+#include <cpuid.h>
+#endif
+
+#ifdef SCRYPT_MULTI_X86
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+
+#define DEFINE_XOR_SALSA8_MULTI(name, vt, tgt) \
+static inline void __attribute__((target(tgt))) name(vt B[16], const vt Bx[16]) \
+{ \
+	vt x[16]; \
+	int i; \
+	for (i = 0; i < 16; i++) \
+		x[i] = (B[i] ^= Bx[i]); \
+	for (i = 0; i < 8; i += 2) { \
+		x[ 4] ^= ROTL(x[ 0] + x[12],  7);  x[ 9] ^= ROTL(x[ 5] + x[ 1],  7); \
+		x[14] ^= ROTL(x[10] + x[ 6],  7);  x[ 3] ^= ROTL(x[15] + x[11],  7); \
+		x[ 8] ^= ROTL(x[ 4] + x[ 0],  9);  x[13] ^= ROTL(x[ 9] + x[ 5],  9); \
+		x[ 2] ^= ROTL(x[14] + x[10],  9);  x[ 7] ^= ROTL(x[ 3] + x[15],  9); \
+		x[12] ^= ROTL(x[ 8] + x[ 4], 13);  x[ 1] ^= ROTL(x[13] + x[ 9], 13); \
+		x[ 6] ^= ROTL(x[ 2] + x[14], 13);  x[11] ^= ROTL(x[ 7] + x[ 3], 13); \
+		x[ 0] ^= ROTL(x[12] + x[ 8], 18);  x[ 5] ^= ROTL(x[ 1] + x[13], 18); \
+		x[10] ^= ROTL(x[ 6] + x[ 2], 18);  x[15] ^= ROTL(x[11] + x[ 7], 18); \
+		x[ 1] ^= ROTL(x[ 0] + x[ 3],  7);  x[ 6] ^= ROTL(x[ 5] + x[ 4],  7); \
+		x[11] ^= ROTL(x[10] + x[ 9],  7);  x[12] ^= ROTL(x[15] + x[14],  7); \
+		x[ 2] ^= ROTL(x[ 1] + x[ 0],  9);  x[ 7] ^= ROTL(x[ 6] + x[ 5],  9); \
+		x[ 8] ^= ROTL(x[11] + x[10],  9);  x[13] ^= ROTL(x[12] + x[15],  9); \
+		x[ 3] ^= ROTL(x[ 2] + x[ 1], 13);  x[ 4] ^= ROTL(x[ 7] + x[ 6], 13); \
+		x[ 9] ^= ROTL(x[ 8] + x[11], 13);  x[14] ^= ROTL(x[13] + x[12], 13); \
+		x[ 0] ^= ROTL(x[ 3] + x[ 2], 18);  x[ 5] ^= ROTL(x[ 4] + x[ 7], 18); \
+		x[10] ^= ROTL(x[ 9] + x[ 8], 18);  x[15] ^= ROTL(x[14] + x[13], 18); \
+	} \
+	for (i = 0; i < 16; i++) \
+		B[i] += x[i]; \
+}
+
+/* ROMix over N interleaved lanes; V must hold 1024 * 32 vectors. */
+#define DEFINE_SCRYPT_CORE_MULTI(name, salsa, vt, N, tgt) \
+static void __attribute__((target(tgt))) name(uint32_t X_in[][32], vt *V) \
+{ \
+	vt X[32]; \
+	uint32_t i, k, l; \
+	for (k = 0; k < 32; k++) \
+		for (l = 0; l < N; l++) \
+			X[k][l] = X_in[l][k]; \
+	for (i = 0; i < 1024; i++) { \
+		memcpy(&V[i * 32], X, sizeof(X)); \
+		salsa(&X[0], &X[16]); \
+		salsa(&X[16], &X[0]); \
+	} \
+	for (i = 0; i < 1024; i++) { \
+		const uint32_t *Vl[N]; \
+		for (l = 0; l < N; l++) \
+			Vl[l] = (const uint32_t *)&V[32 * (X[16][l] & 1023)] + l; \
+		for (k = 0; k < 32; k++) { \
+			vt t; \
+			for (l = 0; l < N; l++) \
+				t[l] = Vl[l][k * N]; \
+			X[k] ^= t; \
+		} \
+		salsa(&X[0], &X[16]); \
+		salsa(&X[16], &X[0]); \
+	} \
+	for (k = 0; k < 32; k++) \
+		for (l = 0; l < N; l++) \
+			X_in[l][k] = X[k][l]; \
+}
+
+DEFINE_XOR_SALSA8_MULTI(xor_salsa8_4way, v4u32, "sse2")
+DEFINE_XOR_SALSA8_MULTI(xor_salsa8_8way, v8u32, "avx2")
+DEFINE_SCRYPT_CORE_MULTI(scrypt_core_4way, xor_salsa8_4way, v4u32, 4, "sse2")
+DEFINE_SCRYPT_CORE_MULTI(scrypt_core_8way, xor_salsa8_8way, v8u32, 8, "avx2")
+
+static int scrypt_cpu_has_sse2(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (edx & bit_SSE2) != 0;
+}
+
+static int scrypt_cpu_has_avx2(void)
+{
+	unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+	__cpuid(1, eax, ebx, ecx, edx);
+	if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+		return 0;
+	/* The OS must save/restore the YMM registers (XCR0 bits 1 and 2). */
+	__asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+	if ((xcr0_lo & 6) != 6)
+		return 0;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & bit_AVX2) != 0;
+}
+
+#endif /* SCRYPT_MULTI_X86 */
+
+/* Lanes used by the selected kernel; 0 until scrypt_best_throughput() runs. */
+static int scrypt_multi_ways = 0;
+
+static void scrypt_1024_1_1_256_sp_ways(const char *input, char *output,
+    char *scratchpad, int ways)
+{
+	uint8_t B[128];
+	uint32_t X[SCRYPT_MAX_WAYS][32];
+	void *V;
+	int l, k;
+
+	V = (void *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (l = 0; l < ways; l++) {
+		PBKDF2_SHA256((const uint8_t *)input + 80 * l, 80,
+		    (const uint8_t *)input + 80 * l, 80, 1, B, 128);
+		for (k = 0; k < 32; k++)
+			X[l][k] = le32dec(&B[4 * k]);
+	}
+
+#ifdef SCRYPT_MULTI_X86
+	if (ways == 8)
+		scrypt_core_8way(X, (v8u32 *)V);
+	else
+		scrypt_core_4way(X, (v4u32 *)V);
+#endif
+
+	for (l = 0; l < ways; l++) {
+		for (k = 0; k < 32; k++)
+			le32enc(&B[4 * k], X[l][k]);
+		PBKDF2_SHA256((const uint8_t *)input + 80 * l, 80, B, 128, 1,
+		    (uint8_t *)output + 32 * l, 32);
+	}
+}
+
+/*
+ * Check a SIMD kernel against the scalar code on a few fixed headers, so a
+ * miscompiled or misdetected kernel can never change a PoW result.
+ */
+static int scrypt_multi_selftest(int ways, char *scratchpad)
+{
+	char input[80 * SCRYPT_MAX_WAYS];
+	char output[32 * SCRYPT_MAX_WAYS];
+	char expected[32];
+	int i;
+
+	for (i = 0; i < 80 * ways; i++)
+		input[i] = (char)(i * 7 + 1);
+	scrypt_1024_1_1_256_sp_ways(input, output, scratchpad, ways);
+	for (i = 0; i < ways; i++) {
+		scrypt_1024_1_1_256_sp(input + 80 * i, expected, scratchpad);
+		if (memcmp(expected, output + 32 * i, 32) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+int scrypt_best_throughput(void)
+{
+	if (scrypt_multi_ways == 0) {
+		int ways = 1;
+#ifdef SCRYPT_MULTI_X86
+		char *scratchpad = malloc(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+		if (scratchpad) {
+			if (scrypt_cpu_has_avx2() && scrypt_multi_selftest(8, scratchpad))
+				ways = 8;
+			else if (scrypt_cpu_has_sse2() && scrypt_multi_selftest(4, scratchpad))
+				ways = 4;
+			free(scratchpad);
+		}
+#endif
+		scrypt_multi_ways = ways;
+	}
+	return scrypt_multi_ways;
+}
+
+int scrypt_1024_1_1_256_sp_kernel(const char *input, char *output,
+    char *scratchpad, int ways)
+{
+	int i;
+
+	if (ways == 1) {
+		scrypt_1024_1_1_256_sp(input, output, scratchpad);
+		return 1;
+	}
+#ifdef SCRYPT_MULTI_X86
+	if ((ways == 8 && scrypt_cpu_has_avx2()) ||
+	    (ways == 4 && scrypt_cpu_has_sse2())) {
+		scrypt_1024_1_1_256_sp_ways(input, output, scratchpad, ways);
+		return 1;
+	}
+#endif
+	for (i = 0; i < 32 * ways; i++)
+		output[i] = 0;
+	return 0;
+}
+
+void scrypt_1024_1_1_256_sp_multi(const char *input, char *output,
+    char *scratchpad, int n)
+{
+	int ways = scrypt_best_throughput();
+
+	while (n > 0) {
+		if (ways == 1 || n < ways) {
+			/* Not worth running a wide kernel on a partial batch. */
+			scrypt_1024_1_1_256_sp(input, output, scratchpad);
+			input += 80; output += 32; n--;
+			continue;
+		}
+		scrypt_1024_1_1_256_sp_ways(input, output, scratchpad, ways);
+		input += 80 * ways; output += 32 * ways; n -= ways;
+	}
+}
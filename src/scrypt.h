@@ -7,9 +7,27 @@ extern "C" {
 
 const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 
+/* Widest SIMD kernel (AVX2, 8 lanes) and the scratchpad it needs. */
+#define SCRYPT_MAX_WAYS 8
+const int SCRYPT_MULTI_SCRATCHPAD_SIZE = SCRYPT_MAX_WAYS * 131072 + 63;
+
 void scrypt_1024_1_1_256_sp(const char *input, char *output, char *scratchpad);
 void scrypt_1024_1_1_256(const char *input, char *output);
 
+/* Number of headers the fastest kernel this CPU supports hashes per pass
+ * (1 = scalar, 4 = SSE2, 8 = AVX2).  Detected and self-tested on first call,
+ * which is not thread safe; AppInit2() makes it before any hashing thread starts. */
+int scrypt_best_throughput(void);
+
+/* Hash ways (1, 4 or 8) consecutive headers with that kernel alone, skipping
+ * the self-test, for checking the kernels against each other.  Returns 0,
+ * leaving the digests zeroed, if this CPU or compiler lacks the kernel. */
+int scrypt_1024_1_1_256_sp_kernel(const char *input, char *output, char *scratchpad, int ways);
+
+/* Hash n consecutive 80-byte headers into n consecutive 32-byte digests.
+ * scratchpad must be SCRYPT_MULTI_SCRATCHPAD_SIZE bytes. */
+void scrypt_1024_1_1_256_sp_multi(const char *input, char *output, char *scratchpad, int n);
+
 #ifdef __cplusplus
 }
 #endif
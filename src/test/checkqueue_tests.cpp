@@ -0,0 +1,126 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+// Counts how often each check ran; fails the ones marked bad
+class CCountingCheck
+{
+public:
+    static boost::mutex mutex;
+    static vector<int> vnRuns;
+
+    int nIndex;
+    bool fBad;
+
+    CCountingCheck() : nIndex(-1), fBad(false) { }
+    CCountingCheck(int nIndexIn, bool fBadIn) : nIndex(nIndexIn), fBad(fBadIn) { }
+
+    bool operator()()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            vnRuns[nIndex]++;
+        }
+        return !fBad;
+    }
+
+    void swap(CCountingCheck& check)
+    {
+        std::swap(nIndex, check.nIndex);
+        std::swap(fBad, check.fBad);
+    }
+};
+
+boost::mutex CCountingCheck::mutex;
+vector<int> CCountingCheck::vnRuns;
+
+// A queue with nWorkers threads besides the one that waits on it
+struct CheckQueueSetup
+{
+    CCheckQueue<CCountingCheck> queue;
+    boost::thread_group threads;
+
+    CheckQueueSetup(int nWorkers) : queue(16)
+    {
+        for (int i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, &queue));
+    }
+
+    ~CheckQueueSetup()
+    {
+        queue.Quit();
+        threads.join_all();
+    }
+
+    // Run nChecks checks as one batch, the one at nBad (if any) failing
+    bool RunBatch(int nChecks, int nBad = -1)
+    {
+        CCountingCheck::vnRuns.assign(nChecks, 0);
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        // Added in several pieces, as ConnectBlock does per transaction
+        for (int nDone = 0; nDone < nChecks; )
+        {
+            vector<CCountingCheck> vChecks;
+            for (int i = 0; i < 7 && nDone < nChecks; i++, nDone++)
+                vChecks.push_back(CCountingCheck(nDone, nDone == nBad));
+            control.Add(vChecks);
+        }
+        return control.Wait();
+    }
+};
+
+BOOST_AUTO_TEST_CASE(checkqueue_runs_each_check_once)
+{
+    CheckQueueSetup setup(3);
+    static const int anChecks[] = { 0, 1, 2, 15, 16, 17, 100, 1000 };
+    for (unsigned int k = 0; k < sizeof(anChecks) / sizeof(anChecks[0]); k++)
+    {
+        int nChecks = anChecks[k];
+        BOOST_CHECK(setup.RunBatch(nChecks));
+        for (int i = 0; i < nChecks; i++)
+            BOOST_CHECK_MESSAGE(CCountingCheck::vnRuns[i] == 1, "check " << i << " of " << nChecks << " ran " << CCountingCheck::vnRuns[i] << " times");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_one_failure_fails_batch)
+{
+    CheckQueueSetup setup(3);
+    static const int anBad[] = { 0, 1, 250, 498, 499 };
+    for (unsigned int k = 0; k < sizeof(anBad) / sizeof(anBad[0]); k++)
+    {
+        BOOST_CHECK(!setup.RunBatch(500, anBad[k]));
+        BOOST_CHECK_EQUAL(CCountingCheck::vnRuns[anBad[k]], 1);
+        // Nothing runs twice, even once the rest is only being drained
+        for (int i = 0; i < 500; i++)
+            BOOST_CHECK(CCountingCheck::vnRuns[i] <= 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_resets_between_batches)
+{
+    CheckQueueSetup setup(3);
+    // A failed batch leaves nothing behind for the next one; the control's
+    // constructor asserts the queue is empty and all OK again
+    for (int nRound = 0; nRound < 20; nRound++)
+    {
+        BOOST_CHECK(!setup.RunBatch(200, nRound * 7));
+        BOOST_CHECK(setup.RunBatch(200));
+        for (int i = 0; i < 200; i++)
+            BOOST_CHECK_EQUAL(CCountingCheck::vnRuns[i], 1);
+    }
+
+    // Same without worker threads: the waiting thread does all the work
+    CheckQueueSetup setupAlone(0);
+    BOOST_CHECK(!setupAlone.RunBatch(50, 10));
+    BOOST_CHECK(setupAlone.RunBatch(50));
+    for (int i = 0; i < 50; i++)
+        BOOST_CHECK_EQUAL(CCountingCheck::vnRuns[i], 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
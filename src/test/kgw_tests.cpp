@@ -0,0 +1,145 @@
+#include <boost/test/unit_test.hpp>
+
+#include <cmath>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kgw_tests)
+
+// Same limit as main.cpp
+static const CBigNum bnLimit(~uint256(0) >> 5);
+
+// The Kimoto Gravity Well as it was before its targets were cached: the
+// whole walk is redone on every call
+static unsigned int KimotoGravityWellReference(const CBlockIndex* pindexLast, uint64 TargetBlocksSpacingSeconds, uint64 PastBlocksMin, uint64 PastBlocksMax)
+{
+    const CBlockIndex  *BlockLastSolved				= pindexLast;
+    const CBlockIndex  *BlockReading				= pindexLast;
+    uint64				PastBlocksMass				= 0;
+    int64				PastRateActualSeconds		= 0;
+    int64				PastRateTargetSeconds		= 0;
+    double				PastRateAdjustmentRatio		= double(1);
+    CBigNum				PastDifficultyAverage;
+    CBigNum				PastDifficultyAveragePrev;
+    double				EventHorizonDeviation;
+    double				EventHorizonDeviationFast;
+    double				EventHorizonDeviationSlow;
+
+    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || (uint64)BlockLastSolved->nHeight < PastBlocksMin) { return bnLimit.GetCompact(); }
+
+    int64 LatestBlockTime = BlockLastSolved->GetBlockTime();
+    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
+        if (PastBlocksMax > 0 && i > PastBlocksMax) { break; }
+        PastBlocksMass++;
+
+        if (i == 1)	{ PastDifficultyAverage.SetCompact(BlockReading->nBits); }
+        else		{ PastDifficultyAverage = ((CBigNum().SetCompact(BlockReading->nBits) - PastDifficultyAveragePrev) / i) + PastDifficultyAveragePrev; }
+        PastDifficultyAveragePrev = PastDifficultyAverage;
+
+        if (LatestBlockTime < BlockReading->GetBlockTime()) {
+            if (BlockReading->nHeight > FIX_KGW_TIMEWARP_HEIGHT)
+                LatestBlockTime = BlockReading->GetBlockTime();
+            }
+        PastRateActualSeconds                   = LatestBlockTime - BlockReading->GetBlockTime();
+        PastRateTargetSeconds			= TargetBlocksSpacingSeconds * PastBlocksMass;
+        PastRateAdjustmentRatio			= double(1);
+        if (BlockReading->nHeight > FIX_KGW_TIMEWARP_HEIGHT) {
+            if (PastRateActualSeconds < 1) { PastRateActualSeconds = 1; }
+        } else {
+            if (PastRateActualSeconds < 0) { PastRateActualSeconds = 0; }
+        }
+        if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+        PastRateAdjustmentRatio			= double(PastRateTargetSeconds) / double(PastRateActualSeconds);
+        }
+        EventHorizonDeviation			= 1 + (0.7084 * pow((double(PastBlocksMass)/double(144)), -1.228));
+        EventHorizonDeviationFast		= EventHorizonDeviation;
+        EventHorizonDeviationSlow		= 1 / EventHorizonDeviation;
+
+        if (PastBlocksMass >= PastBlocksMin) {
+            if ((PastRateAdjustmentRatio <= EventHorizonDeviationSlow) || (PastRateAdjustmentRatio >= EventHorizonDeviationFast)) { assert(BlockReading); break; }
+        }
+        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
+        BlockReading = BlockReading->pprev;
+    }
+
+    CBigNum bnNew(PastDifficultyAverage);
+    if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+        bnNew *= PastRateActualSeconds;
+        bnNew /= PastRateTargetSeconds;
+    }
+    if (bnNew > bnLimit) { bnNew = bnLimit; }
+
+    return bnNew.GetCompact();
+}
+
+static unsigned int ReferenceNextWork(const CBlockIndex* pindexLast)
+{
+    // GetNextWorkRequired_V2's parameters: one minute blocks, looking back
+    // between six hours and a week
+    return KimotoGravityWellReference(pindexLast, 60, 60 * 60 * 24 / 4 / 60, 60 * 60 * 24 * 7 / 60);
+}
+
+// Build nBlocks of chain from nStartHeight, with stretches of fast, slow,
+// steady and out-of-order block times so the event horizon is crossed at
+// many different depths.  Blocks from the KGW activation height on get the
+// nBits GetNextWorkRequired() asks for, which is checked against the full
+// recomputation as it goes.
+static void CheckSyntheticChain(int nStartHeight, int nBlocks, unsigned int nSeed)
+{
+    vector<CBlockIndex*> vChain;
+    unsigned int nRand = nSeed;
+    unsigned int nTime = 1400000000;
+    int nSpacing = 60;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        CBlockIndex* pindex = new CBlockIndex();
+        pindex->pprev = vChain.empty() ? NULL : vChain.back();
+        pindex->nHeight = nStartHeight + i;
+
+        nRand = nRand * 1103515245 + 12345;
+        if (i % 200 == 0)
+        {
+            static const int anSpacing[] = { 60, 15, 240, 55, 5, 600 };
+            nSpacing = anSpacing[(nRand >> 16) % 6];
+        }
+        int nDelta = nSpacing / 2 + (int)((nRand >> 8) % (nSpacing + 1));
+        if ((nRand >> 24) % 16 == 0)
+            nDelta = -(int)((nRand >> 4) % 300);
+        nTime += nDelta;
+        pindex->nTime = nTime;
+
+        if (pindex->pprev && pindex->nHeight >= FIX_SECOND_RETARGET_HEIGHT)
+        {
+            unsigned int nBitsReference = ReferenceNextWork(pindex->pprev);
+            BOOST_CHECK_EQUAL(GetNextWorkRequired(pindex->pprev, NULL), nBitsReference);
+            // Second call is answered from the cache
+            BOOST_CHECK_EQUAL(GetNextWorkRequired(pindex->pprev, NULL), nBitsReference);
+            pindex->nBits = nBitsReference;
+        }
+        else
+            pindex->nBits = 0x1c0a5d3b - (nRand >> 20);
+        vChain.push_back(pindex);
+    }
+
+    // Cached targets are still right once the chain has grown past them
+    for (unsigned int i = 0; i < vChain.size(); i++)
+        if (vChain[i]->nHeight + 1 >= FIX_SECOND_RETARGET_HEIGHT)
+            BOOST_CHECK_EQUAL(GetNextWorkRequired(vChain[i], NULL), ReferenceNextWork(vChain[i]));
+
+    BOOST_FOREACH(CBlockIndex* pindex, vChain)
+        delete pindex;
+}
+
+BOOST_AUTO_TEST_CASE(kgw_activation)
+{
+    CheckSyntheticChain(FIX_SECOND_RETARGET_HEIGHT - 500, 2500, 1);
+}
+
+BOOST_AUTO_TEST_CASE(kgw_timewarp_fix)
+{
+    CheckSyntheticChain(FIX_KGW_TIMEWARP_HEIGHT - 1500, 3000, 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
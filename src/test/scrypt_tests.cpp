@@ -0,0 +1,123 @@
+#include <boost/test/unit_test.hpp>
+
+#include "uint256.h"
+#include "util.h"
+#include "scrypt.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(scrypt_tests)
+
+// Litecoin block headers and their scrypt hashes
+static const char* pszHeaderHex[] = {
+    "020000004c1271c211717198227392b029a64a7971931d351b387bb80db027f270411e398a07046f7d4a08dd815412a8712f874a7ebf0507e3878bd24e20a3b73fd750a667d2f451eac7471b00de6659",
+    "0200000011503ee6a855e900c00cfdd98f5f55fffeaee9b6bf55bea9b852d9de2ce35828e204eef76acfd36949ae56d1fbe81c1ac9c0209e6331ad56414f9072506a77f8c6faf551eac7471b00389d01",
+    "02000000a72c8a177f523946f42f22c3e86b8023221b4105e8007e59e81f6beb013e29aaf635295cb9ac966213fb56e046dc71df5b3f7f67ceaeab24038e743f883aff1aaafaf551eac7471b0166249b",
+    "010000007824bc3a8a1b4628485eee3024abd8626721f7f870f8ad4d2f33a27155167f6a4009d1285049603888fe85a84b6c803a53305a8d497965a5e896e1a00568359589faf551eac7471b0065434e",
+    "0200000050bfd4e4a307a8cb6ef4aef69abc5c0f2d579648bd80d7733e1ccc3fbc90ed664a7f74006cb11bde87785f229ecd366c2d4e44432832580e0608c579e4cb76f383f7f551eac7471b00c36982",
+};
+static const char* pszHashHex[] = {
+    "00000000002bef4107f882f6115e0b01f348d21195dacd3582aa2dabd7985806",
+    "00000000003a0d11bdd5eb634e08b7feddcfbbf228ed35d250daf19f1c88fc94",
+    "00000000000b40f895f288e13244728a6c2d9d59d8aff29c65f8dd5114a8ca81",
+    "00000000003007005891cd4923031e99d8e8d72f6e8e7edc6a86181897e105fe",
+    "000000000018f0b426a4afc7130ccb47fa02af730d345b4fe7c7724d3800ec8c",
+};
+static const unsigned int nKnown = sizeof(pszHeaderHex) / sizeof(pszHeaderHex[0]);
+
+// The known headers followed by nRandom pseudo-random ones
+static vector<unsigned char> TestHeaders(unsigned int nRandom)
+{
+    vector<unsigned char> vHeaders;
+    for (unsigned int i = 0; i < nKnown; i++)
+    {
+        vector<unsigned char> vHeader = ParseHex(pszHeaderHex[i]);
+        BOOST_REQUIRE_EQUAL(vHeader.size(), 80U);
+        vHeaders.insert(vHeaders.end(), vHeader.begin(), vHeader.end());
+    }
+    unsigned int nRand = 12345;
+    for (unsigned int i = 0; i < 80 * nRandom; i++)
+    {
+        nRand = nRand * 1103515245 + 12345;
+        vHeaders.push_back((unsigned char)(nRand >> 16));
+    }
+    return vHeaders;
+}
+
+// Scalar digests of every header, one at a time
+static vector<unsigned char> ScalarHashes(const vector<unsigned char>& vHeaders, char* scratchpad)
+{
+    unsigned int nHeaders = vHeaders.size() / 80;
+    vector<unsigned char> vHashes(32 * nHeaders);
+    for (unsigned int i = 0; i < nHeaders; i++)
+        scrypt_1024_1_1_256_sp((const char*)&vHeaders[80 * i], (char*)&vHashes[32 * i], scratchpad);
+    return vHashes;
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_known_hashes)
+{
+    vector<char> vScratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    vector<unsigned char> vHeaders = TestHeaders(0);
+    vector<unsigned char> vHashes = ScalarHashes(vHeaders, &vScratchpad[0]);
+    for (unsigned int i = 0; i < nKnown; i++)
+    {
+        uint256 hash;
+        memcpy(BEGIN(hash), &vHashes[32 * i], 32);
+        BOOST_CHECK_EQUAL(hash.GetHex(), pszHashHex[i]);
+    }
+
+    // The allocating wrapper gives the same
+    uint256 hash;
+    scrypt_1024_1_1_256((const char*)&vHeaders[0], BEGIN(hash));
+    BOOST_CHECK_EQUAL(hash.GetHex(), pszHashHex[0]);
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_kernels_agree)
+{
+    vector<char> vScratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    // A whole number of 8-lane batches: the known headers and 35 random ones
+    vector<unsigned char> vHeaders = TestHeaders(5 * SCRYPT_MAX_WAYS - nKnown);
+    unsigned int nHeaders = vHeaders.size() / 80;
+    vector<unsigned char> vExpected = ScalarHashes(vHeaders, &vScratchpad[0]);
+
+    static const int anWays[] = { 1, 4, 8 };
+    for (unsigned int k = 0; k < sizeof(anWays) / sizeof(anWays[0]); k++)
+    {
+        int nWays = anWays[k];
+        vector<unsigned char> vHashes(32 * nHeaders);
+        bool fSupported = true;
+        for (unsigned int i = 0; i < nHeaders && fSupported; i += nWays)
+            fSupported = scrypt_1024_1_1_256_sp_kernel((const char*)&vHeaders[80 * i], (char*)&vHashes[32 * i], &vScratchpad[0], nWays);
+        if (!fSupported)
+        {
+            BOOST_TEST_MESSAGE("scrypt " << nWays << "-way kernel not supported here, skipped");
+            continue;
+        }
+        for (unsigned int i = 0; i < nHeaders; i++)
+            BOOST_CHECK_MESSAGE(memcmp(&vHashes[32 * i], &vExpected[32 * i], 32) == 0,
+                                "header " << i << " hashes differently with the " << nWays << "-way kernel");
+    }
+
+    // The kernel picked for this CPU is one of those
+    int nBest = scrypt_best_throughput();
+    BOOST_CHECK(nBest == 1 || nBest == 4 || nBest == 8);
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_multi_partial_batches)
+{
+    vector<char> vScratchpad(SCRYPT_MULTI_SCRATCHPAD_SIZE);
+    vector<unsigned char> vHeaders = TestHeaders(2 * SCRYPT_MAX_WAYS + 1 - nKnown);
+    vector<unsigned char> vExpected = ScalarHashes(vHeaders, &vScratchpad[0]);
+
+    // Every count from a single header to past two full batches, so the
+    // tail that falls back to the scalar code is covered for every kernel
+    for (unsigned int n = 1; n <= vHeaders.size() / 80; n++)
+    {
+        vector<unsigned char> vHashes(32 * n);
+        scrypt_1024_1_1_256_sp_multi((const char*)&vHeaders[0], (char*)&vHashes[0], &vScratchpad[0], n);
+        BOOST_CHECK_MESSAGE(memcmp(&vHashes[0], &vExpected[0], 32 * n) == 0,
+                            "scrypt_1024_1_1_256_sp_multi differs for " << n << " headers");
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
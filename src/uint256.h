@@ -171,6 +171,45 @@ public:
     }
 
 
+    base_uint& operator*=(unsigned int b32)
+    {
+        uint64 carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64 n = carry + (uint64)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    base_uint& operator/=(const base_uint& b)
+    {
+        // Shift-and-subtract long division, dividing by zero gives zero
+        base_uint div = b;
+        base_uint num = *this;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int nNumBits = num.bits();
+        int nDivBits = div.bits();
+        if (nDivBits == 0 || nDivBits > nNumBits)
+            return *this;
+        int nShift = nNumBits - nDivBits;
+        div <<= nShift;
+        while (nShift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[nShift / 32] |= (1U << (nShift & 31));
+            }
+            div >>= 1;
+            nShift--;
+        }
+        return *this;
+    }
+
+
     base_uint& operator++()
     {
         // prefix operator
@@ -356,6 +395,34 @@ public:
         return pn[2*n] | (uint64)pn[2*n+1] << 32;
     }
 
+    // Position of the highest set bit plus one, 0 for zero
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH-1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nBits = 31; nBits > 0; nBits--)
+                    if (pn[pos] & (1U << nBits))
+                        return 32 * pos + nBits + 1;
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
+    double getdouble() const
+    {
+        double ret = 0.0;
+        double fact = 1.0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            ret += fact * pn[i];
+            fact *= 4294967296.0;
+        }
+        return ret;
+    }
+
 //    unsigned int GetSerializeSize(int nType=0, int nVersion=PROTOCOL_VERSION) const
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
@@ -568,6 +635,29 @@ public:
         else
             *this = 0;
     }
+
+    // Decode the compact nBits form the same way CBigNum::SetCompact does,
+    // flagging what a uint256 can't hold: a negative or too large value
+    uint256& SetCompact(unsigned int nCompact, bool* pfNegative=NULL, bool* pfOverflow=NULL)
+    {
+        int nSize = nCompact >> 24;
+        unsigned int nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && (nSize > 34 || (nWord > 0xff && nSize > 33) || (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
 };
 
 inline bool operator==(const uint256& a, uint64 b)                           { return (base_uint256)a == b; }
@@ -582,6 +672,8 @@ inline const uint256 operator&(const base_uint256& a, const base_uint256& b) { r
 inline const uint256 operator|(const base_uint256& a, const base_uint256& b) { return uint256(a) |= b; }
 inline const uint256 operator+(const base_uint256& a, const base_uint256& b) { return uint256(a) += b; }
 inline const uint256 operator-(const base_uint256& a, const base_uint256& b) { return uint256(a) -= b; }
+inline const uint256 operator/(const base_uint256& a, const base_uint256& b) { return uint256(a) /= b; }
+inline const uint256 operator*(const base_uint256& a, unsigned int b)        { return uint256(a) *= b; }
 
 inline bool operator<(const base_uint256& a, const uint256& b)          { return (base_uint256)a <  (base_uint256)b; }
 inline bool operator<=(const base_uint256& a, const uint256& b)         { return (base_uint256)a <= (base_uint256)b; }
@@ -188,6 +188,12 @@ uint256 GetRandHash()
     return hash;
 }
 
+CSaltedHasher::CSaltedHasher()
+{
+    RAND_bytes((unsigned char*)&k0, sizeof(k0));
+    RAND_bytes((unsigned char*)&k1, sizeof(k1));
+}
+
 int GetCurrentHeight(){
     return(0);
 }
@@ -486,6 +486,30 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 }
 
 
+/** Hash function for unordered containers keyed by a block or transaction
+ * hash.  The key's bits are already uniform, so two of its words are just
+ * mixed with a random salt picked per container: someone grinding hashes
+ * can't know which of them will share a bucket.
+ */
+class CSaltedHasher
+{
+private:
+    uint64 k0, k1;
+
+public:
+    CSaltedHasher();
+
+    size_t Hash(const uint256& hash, uint64 nExtra) const
+    {
+        uint64 a = (hash.Get64(0) ^ k0) * 0x9e3779b97f4a7c15ULL;
+        uint64 b = (hash.Get64(1) ^ k1 ^ nExtra ^ (a >> 29)) * 0xbf58476d1ce4e5b9ULL;
+        return (size_t)(b ^ (b >> 32));
+    }
+
+    size_t operator()(const uint256& hash) const { return Hash(hash, 0); }
+};
+
+
 /** Median filter over a stream of values. 
  * Returns the median of the last N numbers
  */
@@ -17,7 +17,7 @@
 #define CLIENT_VERSION_MAJOR       0
 #define CLIENT_VERSION_MINOR       6
 #define CLIENT_VERSION_REVISION    4
-#define CLIENT_VERSION_BUILD       6
+#define CLIENT_VERSION_BUILD       8
 
 static const int CLIENT_VERSION =
                            1000000 * CLIENT_VERSION_MAJOR
@@ -53,4 +53,16 @@ static const int NOBLKS_VERSION_END = 32400;
 // BIP 0031, pong message, is enabled for all versions AFTER this one
 static const int BIP0031_VERSION = 60000;
 
+//
+// database versioning
+//
+
+// blkindex.dat block index entries carry the block's scrypt hash from this
+// client version on
+static const int POWHASH_INDEX_VERSION = 60407;
+
+// unspent outputs live in blkindex.dat coin records from this client version
+// on; transaction index entries no longer carry spent pointers
+static const int COINS_INDEX_VERSION = 60408;
+
 #endif
@@ -726,34 +726,37 @@ void CWallet::ReacceptWalletTransactions()
     bool fRepeat = true;
     while (fRepeat)
     {
-        LOCK(cs_wallet);
+        LOCK2(cs_main, cs_wallet);
+        CCoinsCache view(txdb);
         fRepeat = false;
-        vector<CDiskTxPos> vMissingTx;
+        bool fMissingTx = false;
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
         {
             CWalletTx& wtx = item.second;
             if (wtx.IsCoinBase() && wtx.IsSpent(0))
                 continue;
 
-            CTxIndex txindex;
             bool fUpdated = false;
-            if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
+            if (txdb.ContainsTx(wtx.GetHash()))
             {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                if (txindex.vSpent.size() != wtx.vout.size())
+                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat;
+                // outputs missing from the coin database have been spent
+                CCoins coins;
+                bool fHaveCoins = view.GetCoins(wtx.GetHash(), coins);
+                if (fHaveCoins && coins.vout.size() != wtx.vout.size())
                 {
-                    printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %d != wtx.vout.size() %d\n", txindex.vSpent.size(), wtx.vout.size());
+                    printf("ERROR: ReacceptWalletTransactions() : coins.vout.size() %d != wtx.vout.size() %d\n", coins.vout.size(), wtx.vout.size());
                     continue;
                 }
-                for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+                for (unsigned int i = 0; i < wtx.vout.size(); i++)
                 {
                     if (wtx.IsSpent(i))
                         continue;
-                    if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                    if (!(fHaveCoins && coins.IsAvailable(i)) && IsMine(wtx.vout[i]))
                     {
                         wtx.MarkSpent(i);
                         fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        fMissingTx = true;
                     }
                 }
                 if (fUpdated)
@@ -770,7 +773,7 @@ void CWallet::ReacceptWalletTransactions()
                     wtx.AcceptWalletTransaction(txdb, false);
             }
         }
-        if (!vMissingTx.empty())
+        if (fMissingTx)
         {
             // TODO: optimize this to scan just part of the block chain?
             if (ScanForWalletTransactions(pindexGenesisBlock))
@@ -1184,6 +1187,9 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend, CW
                 int64 nPayFee = nTransactionFee * (1 + (int64)nBytes / 1000);
                 bool fAllowFree = CTransaction::AllowFree(dPriority);
                 int64 nMinFee = wtxNew.GetMinFee(1, fAllowFree, GMF_SEND);
+                // Also what the memory pool wants once it has been full,
+                // checked here before any coins are marked spent
+                nMinFee = max(nMinFee, mempool.GetMinFee(nBytes));
                 if (nFeeRet < max(nPayFee, nMinFee))
                 {
                     nFeeRet = max(nPayFee, nMinFee);